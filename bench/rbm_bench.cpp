@@ -0,0 +1,331 @@
+/*
+ * Kernel-level micro-benchmarks for the RBM hot paths
+ *
+ * Every kernel is timed at each combination of visible units, hidden
+ * units and rows, and reported as one JSON object per line on stdout:
+ *
+ *   {"kernel":"neg_hidden_probs","precision":"float","simd":"avx2","input":"dense",
+ *    "visible":784,"hidden":256,"rows":1024,"threads":1,"density":0.5,
+ *    "iterations":64,"seconds":0.0012,"flops":4.1e+08,"gflops":341.2,
+ *    "bytes":4.2e+06,"gbytes_per_s":3.5,"rows_per_s":853333}
+ *
+ * flops counts the dense products (2*m*n*k per Gemm) even where the masked
+ * kernels skip zeros, so numbers stay comparable across densities. bytes
+ * is the compulsory traffic of each call (operands read once, results
+ * written once, binary data at one bit per element, or four bytes per one
+ * for sparse input), not a measurement.
+ *
+ * Usage: rbm_bench [--visible 784,4096] [--hidden 256,1024] [--rows 1024]
+ *                  [--threads N] [--precision double|float|all]
+ *                  [--density 0.5] [--min-time 0.25] [--epochs 3]
+ *                  [--input dense|sparse]
+ *
+ * Kernels run single-threaded on rows [0, rows); update_weights and the
+ * epoch entry use --threads workers, the epoch training the whole data
+ * set as one batch. --input sparse hands the model CSR data, which moves
+ * pos_hidden_probs, pos_associations and update_error to the sparse kernels.
+ * RBM_SIMD caps the instruction set as in training.
+ */
+#define RBM_NO_MAIN
+#include "../boltzmann.cpp"
+
+struct bench_config
+{
+    std::vector<uint64_t> visible;
+    std::vector<uint64_t> hidden;
+    std::vector<uint64_t> rows;
+    unsigned threads;
+    string precision;
+    string input;
+    double density;
+    double min_time;
+    uint32_t epochs;
+};
+
+struct bench_result
+{
+    const char *kernel;
+    uint64_t iterations;
+    double seconds;         /* per call */
+    double flops;           /* per call */
+    double bytes;           /* per call */
+    double rows;            /* per call, 0 where rows do not apply */
+    unsigned threads;
+};
+
+static std::vector<uint64_t> Parse_list(const char *text)
+{
+    std::vector<uint64_t> values;
+    std::stringstream in(text);
+    string item;
+
+    while(std::getline(in, item, ','))
+        if(!item.empty())
+            values.push_back(strtoull(item.c_str(), NULL, 10));
+
+    return values;
+}
+
+/* A shape list is usable when it is non-empty and free of zeros */
+static bool Valid_list(const std::vector<uint64_t> &values)
+{
+    if(values.empty())
+        return FALSE;
+
+    for(size_t i=0;i<values.size();++i)
+        if(values[i] == 0)
+            return FALSE;
+
+    return TRUE;
+}
+
+static bool Parse_args(int argc, char **argv, bench_config &config)
+{
+    config.visible = Parse_list("784,4096");
+    config.hidden = Parse_list("256,1024");
+    config.rows = Parse_list("1024");
+    config.threads = std::thread::hardware_concurrency();
+    config.precision = "all";
+    config.input = "dense";
+    config.density = 0.5;
+    config.min_time = 0.25;
+    config.epochs = 3;
+
+    for(int i=1;i+1<argc;i+=2)
+    {
+        string flag = argv[i];
+        const char *value = argv[i+1];
+
+        if(flag == "--visible")
+            config.visible = Parse_list(value);
+        else if(flag == "--hidden")
+            config.hidden = Parse_list(value);
+        else if(flag == "--rows")
+            config.rows = Parse_list(value);
+        else if(flag == "--threads")
+            config.threads = (unsigned)atoi(value);
+        else if(flag == "--precision")
+            config.precision = value;
+        else if(flag == "--input")
+            config.input = value;
+        else if(flag == "--density")
+            config.density = atof(value);
+        else if(flag == "--min-time")
+            config.min_time = atof(value);
+        else if(flag == "--epochs")
+            config.epochs = (uint32_t)atoi(value);
+        else
+            return FALSE;
+    }
+
+    if(config.threads == 0)
+        config.threads = 1;
+
+    /* Every flag takes a value */
+    return argc % 2 == 1 && config.epochs > 0
+           && (config.input == "dense" || config.input == "sparse")
+           && (config.precision == "double" || config.precision == "float" || config.precision == "all")
+           && Valid_list(config.visible) && Valid_list(config.hidden) && Valid_list(config.rows);
+}
+
+/* Seconds per call: doubles the repeat count until a run lasts min_time */
+template <typename F>
+static double Time_per_call(F call, double min_time, uint64_t &iterations)
+{
+    call();
+
+    for(iterations=1;;iterations*=2)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(uint64_t i=0;i<iterations;++i)
+            call();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if(seconds >= min_time || iterations >= (1ull << 30))
+            return seconds/iterations;
+    }
+}
+
+static void Print_result(const bench_result &r, const char *precision, const char *simd,
+                         const char *input, uint64_t visible, uint64_t hidden, uint64_t rows,
+                         double density)
+{
+    printf("{\"kernel\":\"%s\",\"precision\":\"%s\",\"simd\":\"%s\",\"input\":\"%s\","
+           "\"visible\":%llu,\"hidden\":%llu,\"rows\":%llu,\"threads\":%u,\"density\":%g,"
+           "\"iterations\":%llu,\"seconds\":%.9g,\"flops\":%.6g,\"gflops\":%.6g,"
+           "\"bytes\":%.6g,\"gbytes_per_s\":%.6g,\"rows_per_s\":%.6g}\n",
+           r.kernel, precision, simd, input,
+           (unsigned long long)visible, (unsigned long long)hidden, (unsigned long long)rows,
+           r.threads, density, (unsigned long long)r.iterations, r.seconds,
+           r.flops, r.flops/r.seconds*1e-9, r.bytes, r.bytes/r.seconds*1e-9,
+           r.rows/r.seconds);
+    fflush(stdout);
+}
+
+template <typename T>
+static void Bench_shape(const bench_config &config, const char *precision,
+                        uint64_t visible, uint64_t hidden, uint64_t rows)
+{
+    const double V = (double)visible;
+    const double H = (double)hidden;
+    const double B = (double)rows;
+    const double s = (double)sizeof(T);
+    const char *simd = Simd<T>().name;
+    const char *input = config.input.c_str();
+    const bool sparse = config.input == "sparse";
+
+    /* Compulsory bytes of the batch data: bits, or a column index per one */
+    const double D = sparse? 4*B*(1 + V*config.density) : B*V/8;
+
+    matrix_bool data;
+    csr_matrix sparse_data;
+    struct random fill;
+    fill.set_random_seed(1);
+
+    if(sparse)
+    {
+        sparse_data.clear(visible);
+        for(uint64_t i=0;i<rows;++i)
+        {
+            for(uint64_t j=0;j<visible;++j)
+                if(fill.generate_random(0.0, 1.0) < config.density)
+                    sparse_data.add((uint32_t)j);
+            sparse_data.end_row();
+        }
+    }
+    else
+    {
+        data.assign(rows, vect_bool(visible));
+        for(uint64_t i=0;i<rows;++i)
+            for(uint64_t j=0;j<visible;++j)
+                data[i][j] = fill.generate_random(0.0, 1.0) < config.density;
+    }
+
+    basic_rbm<T> net("", LOG_OFF, LOG_OFF);
+    net.Init_RBM(hidden, visible, 0.01);
+    net.set_random_seed(1);
+    net.Init_weights();
+    if(sparse)
+        net.Get_data(sparse_data, rows);
+    else
+        net.Get_data(data, rows);
+    net.Set_batch_size(0);
+    net.Set_threads(config.threads);
+
+    /* Full epochs first; they also leave every training buffer configured */
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(!net.RBM_train(config.epochs))
+        return;
+    double epoch = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                   /config.epochs;
+
+    bench_result train = { "epoch", config.epochs, epoch,
+                           10*B*V*H + 3*V*H + 3*B*V,
+                           3*D + 2*B*H/8 + 4*B*V*s + 5*B*H*s + 9*V*H*s, B, config.threads };
+    Print_result(train, precision, simd, input, visible, hidden, rows, config.density);
+
+    /* Caller-side buffers for the kernels that take their operands */
+    bit_matrix states;
+    dense_matrix<T> visible_probs;
+    dense_matrix<T> hidden_probs;
+    rbm_gradient<T> assoc;
+    states.resize(rows, hidden);
+    visible_probs.resize(rows, visible);
+    hidden_probs.resize(rows, hidden);
+    assoc.resize(visible, hidden);
+
+    hidden_probs.fill((T)0.5);
+    net.Compute_hidden_states(hidden_probs, states, 0, rows, 0, RNG_STREAM_HIDDEN, 0, 0);
+
+    std::vector<bench_result> results;
+    bench_result r;
+    r.threads = 1;
+
+    r.kernel = "pos_hidden_probs"; r.flops = 2*B*V*H; r.rows = B;
+    r.bytes = D + V*H*s + B*H*s + B*H/8;
+    r.seconds = Time_per_call([&]{ net.Compute_pos_hidden_probs(0, rows, 0); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    r.kernel = "neg_visible_probs"; r.flops = 2*B*V*H; r.rows = B;
+    r.bytes = B*H/8 + V*H*s + B*V*s;
+    r.seconds = Time_per_call([&]{ net.Compute_neg_visible_probs(states, visible_probs, 0, rows); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    r.kernel = "neg_hidden_probs"; r.flops = 2*B*V*H; r.rows = B;
+    r.bytes = B*V*s + V*H*s + B*H*s;
+    r.seconds = Time_per_call([&]{ net.Compute_neg_hidden_probs(visible_probs, hidden_probs, 0, rows); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    r.kernel = "pos_associations"; r.flops = 2*B*V*H; r.rows = B;
+    r.bytes = D + B*H*s + V*H*s;
+    r.seconds = Time_per_call([&]{ net.Compute_pos_associations(0, rows, assoc); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    r.kernel = "neg_associations"; r.flops = 2*B*V*H; r.rows = B;
+    r.bytes = B*V*s + B*H*s + V*H*s;
+    r.seconds = Time_per_call([&]{ net.Compute_neg_associations(visible_probs, hidden_probs,
+                                                                0, rows, 1.0, assoc); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    r.kernel = "hidden_states"; r.flops = B*H; r.rows = B;
+    r.bytes = B*H*s + B*H/8;
+    r.seconds = Time_per_call([&]{ net.Compute_hidden_states(hidden_probs, states, 0, rows, 0,
+                                                             RNG_STREAM_HIDDEN, 0, 0); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    r.kernel = "gibbs_sampling"; r.flops = 6*B*V*H; r.rows = B;
+    r.bytes = D + 2*B*H/8 + 3*V*H*s + 2*B*V*s + 3*B*H*s;
+    r.seconds = Time_per_call([&]{ net.Gibbs_sampling(0, rows, 0); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    /* Update_weights always runs on the training pool */
+    r.kernel = "update_weights"; r.flops = 3*V*H; r.rows = 0;
+    r.bytes = 3*V*H*s; r.threads = config.threads;
+    r.seconds = Time_per_call([&]{ net.Update_weights(); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+    r.threads = 1;
+
+    r.kernel = "update_error"; r.flops = 3*B*V; r.rows = B;
+    r.bytes = D + B*V*s;
+    /* The sum is kept, or the whole sweep is optimised away */
+    volatile double error_sink = 0.0;
+    r.seconds = Time_per_call([&]{ error_sink = net.Update_error(0, rows); },
+                              config.min_time, r.iterations);
+    results.push_back(r);
+
+    for(size_t i=0;i<results.size();++i)
+        Print_result(results[i], precision, simd, input, visible, hidden, rows, config.density);
+}
+
+int main(int argc, char **argv)
+{
+    bench_config config;
+
+    if(!Parse_args(argc, argv, config))
+    {
+        fprintf(stderr, "usage: %s [--visible 784,4096] [--hidden 256,1024] [--rows 1024]\n"
+                        "       [--threads N] [--precision double|float|all] [--density 0.5]\n"
+                        "       [--min-time 0.25] [--epochs 3] [--input dense|sparse]\n", argv[0]);
+        return 1;
+    }
+
+    for(size_t v=0;v<config.visible.size();++v)
+        for(size_t h=0;h<config.hidden.size();++h)
+            for(size_t r=0;r<config.rows.size();++r)
+            {
+                if(config.precision == "all" || config.precision == "double")
+                    Bench_shape<double>(config, "double", config.visible[v], config.hidden[h], config.rows[r]);
+                if(config.precision == "all" || config.precision == "float")
+                    Bench_shape<float>(config, "float", config.visible[v], config.hidden[h], config.rows[r]);
+            }
+
+    return 0;
+}
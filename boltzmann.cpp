@@ -1,17 +1,64 @@
 #include <ctime>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <thread>
 #include <vector>
 #include <math.h>
 #include <random>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
 #include <iomanip>
 #include <fstream>
+#include <future>
+#include <algorithm>
 #include <string.h>
+#include <sstream>
 #include <iostream>
+#include <functional>
 #include <sys/stat.h>
+#include <condition_variable>
+
+#ifdef _MSC_VER
+    #include <malloc.h>
+#endif
+
+/* POSIX file mapping and positioned reads where the platform has them */
+#if defined(_WIN32)
+    #define RBM_POSIX 0
+#else
+    #define RBM_POSIX 1
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define RBM_X86 1
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #else
+        #include <cpuid.h>
+    #endif
+#else
+    #define RBM_X86 0
+#endif
+
+/* Per-function instruction set selection for the dispatched SIMD kernels */
+#if defined(__GNUC__) || defined(__clang__)
+    #define RBM_TARGET(isa) __attribute__((target(isa)))
+#else
+    #define RBM_TARGET(isa)
+#endif
 
 #define TRUE 1
 #define FALSE 0
-#define DEBUG 1
-#define FILE 1
 
 using namespace std;
 
@@ -21,1229 +68,6511 @@ typedef std::vector<double> vect_double;
 typedef std::vector<vector<bool> > matrix_bool;
 typedef std::vector<vector<double> > matrix_double;
 
-/* Structure for Random Number Generation */
-struct random
+/* Alignment (in bytes) of every matrix buffer and row */
+#define MATRIX_ALIGN 64
+
+#ifdef _MSC_VER
+    #define MATRIX_ALIGNED __declspec(align(64))
+#else
+    #define MATRIX_ALIGNED __attribute__((aligned(64)))
+#endif
+
+/* Aligned Memory Allocation */
+inline void *aligned_malloc(size_t bytes)
 {
-    double standard_deviation;
+    void *ptr = NULL;
 
-    /* Membership Functions */
-    void set_random_seed();
-    double generate_random(double lower_limit, double higher_limit);
+    if(bytes == 0)
+        bytes = MATRIX_ALIGN;
+
+    #ifdef _MSC_VER
+        ptr = _aligned_malloc(bytes, MATRIX_ALIGN);
+    #else
+        if(posix_memalign(&ptr, MATRIX_ALIGN, bytes) != 0)
+            ptr = NULL;
+    #endif
+
+    if(ptr == NULL)
+        throw std::bad_alloc();
 
+    return ptr;
+}
+
+inline void aligned_free(void *ptr)
+{
+    #ifdef _MSC_VER
+        _aligned_free(ptr);
+    #else
+        free(ptr);
+    #endif
+}
+
+/* Non-owning view of one matrix row (contiguous) */
+template <typename T>
+struct row_view
+{
+    T *ptr;
+    size_t length;
+
+    T &operator[](size_t i) const { return ptr[i]; }
+    size_t size() const { return length; }
 };
 
-/* Restricted Boltzmann Machine Class */
-class RBM : public random
+/* Non-owning view of one matrix column (strided) */
+template <typename T>
+struct col_view
 {
-   private:
-        bool net_stat;
-        bool ready_to_train;
-        uint8_t bias_init_type;
+    T *ptr;
+    size_t length;
+    size_t stride;
 
-        double learning_rate;
+    T &operator[](size_t i) const { return ptr[i*stride]; }
+    size_t size() const { return length; }
+};
 
-        vect_double error;
+/*
+ * Dense row-major matrix backed by a single MATRIX_ALIGN aligned buffer.
+ * Rows are padded to a multiple of MATRIX_ALIGN bytes, so the start of
+ * every row is aligned as well; row_stride() is the distance (in
+ * elements) between the starts of two consecutive rows.
+ */
+template <typename T>
+class dense_matrix
+{
+    private:
+        T *buffer;
+        size_t nrows;
+        size_t ncols;
+        size_t stride;
+        size_t capacity;
+        bool owned;
+
+        static size_t Padded_stride(size_t cols)
+        {
+            const size_t per_line = MATRIX_ALIGN/sizeof(T);
+            if(cols > SIZE_MAX - per_line)
+                throw std::bad_alloc();
+            return ((cols + per_line - 1)/per_line)*per_line;
+        }
 
-        ofstream log_file;
+    public:
+        dense_matrix() : buffer(NULL), nrows(0), ncols(0), stride(0), capacity(0), owned(true) {}
 
-        uint16_t num_hidden;
-        uint16_t num_visible;
-        uint16_t train_data_rows;
-        uint16_t train_data_cols;
+        dense_matrix(size_t rows, size_t cols)
+            : buffer(NULL), nrows(0), ncols(0), stride(0), capacity(0), owned(true)
+        {
+            resize(rows, cols);
+        }
 
-        uint32_t curr_epoch;
-        uint32_t epochs;
+        dense_matrix(const dense_matrix &other)
+            : buffer(NULL), nrows(0), ncols(0), stride(0), capacity(0), owned(true)
+        {
+            *this = other;
+        }
+
+        dense_matrix &operator=(const dense_matrix &other)
+        {
+            if(this != &other)
+            {
+                resize(other.nrows, other.ncols);
+                if(nrows)
+                    memcpy(buffer, other.buffer, nrows*stride*sizeof(T));
+            }
+            return *this;
+        }
+
+        ~dense_matrix()
+        {
+            if(buffer && owned)
+                aligned_free(buffer);
+        }
+
+        /* Reshapes the matrix; contents are zero-filled */
+        void resize(size_t rows, size_t cols)
+        {
+            size_t new_stride = Padded_stride(cols);
+
+            /* rows*stride elements must fit in a size_t byte count */
+            if(new_stride && rows > SIZE_MAX/sizeof(T)/new_stride)
+                throw std::bad_alloc();
+
+            size_t needed = rows*new_stride;
+
+            /* Attached storage is never resized in place */
+            if(!owned)
+            {
+                buffer = NULL;
+                capacity = 0;
+                owned = true;
+            }
+
+            if(needed > capacity)
+            {
+                if(buffer)
+                    aligned_free(buffer);
+                buffer = static_cast<T *>(aligned_malloc(needed*sizeof(T)));
+                capacity = needed;
+            }
+
+            nrows = rows;
+            ncols = cols;
+            stride = new_stride;
+
+            if(needed)
+                memset(buffer, 0, needed*sizeof(T));
+        }
+
+        /* Uses external storage (e.g. a mapped checkpoint) without copying;
+           the caller keeps it alive for as long as the matrix uses it */
+        void attach(T *ptr, size_t rows, size_t cols, size_t row_step)
+        {
+            if(buffer && owned)
+                aligned_free(buffer);
+
+            buffer = ptr;
+            nrows = rows;
+            ncols = cols;
+            stride = row_step;
+            capacity = rows*row_step;
+            owned = false;
+        }
+
+        void fill(T value)
+        {
+            for(size_t i=0;i<nrows;++i)
+            {
+                T *r = row(i);
+                for(size_t j=0;j<ncols;++j)
+                    r[j] = value;
+            }
+        }
+
+        void swap(dense_matrix &other)
+        {
+            std::swap(buffer, other.buffer);
+            std::swap(nrows, other.nrows);
+            std::swap(ncols, other.ncols);
+            std::swap(stride, other.stride);
+            std::swap(capacity, other.capacity);
+            std::swap(owned, other.owned);
+        }
 
-        matrix_bool data;
-        matrix_bool pos_hidden_states;
+        size_t rows() const { return nrows; }
+        size_t bytes() const { return owned? capacity*sizeof(T) : 0; }
+        size_t cols() const { return ncols; }
+        size_t row_stride() const { return stride; }
 
-        matrix_double weights;
+        T *data() { return buffer; }
+        const T *data() const { return buffer; }
 
-        matrix_double pos_associations;
-        matrix_double neg_associations;
+        T *row(size_t i) { return buffer + i*stride; }
+        const T *row(size_t i) const { return buffer + i*stride; }
 
-        matrix_double pos_hidden_probs;
-        matrix_double neg_visible_probs;
-        matrix_double neg_hidden_probs;
+        T &operator()(size_t i, size_t j) { return buffer[i*stride + j]; }
+        const T &operator()(size_t i, size_t j) const { return buffer[i*stride + j]; }
 
-        matrix_double pos_hidden_activations;
-        matrix_double neg_visible_activations;
-        matrix_double neg_hidden_activations;
+        row_view<T> row_at(size_t i)
+        {
+            row_view<T> view = { row(i), ncols };
+            return view;
+        }
+
+        col_view<T> col_at(size_t j)
+        {
+            col_view<T> view = { buffer + j, nrows, stride };
+            return view;
+        }
+};
+
+typedef dense_matrix<double> dense_double;
+typedef dense_matrix<uint8_t> dense_bool;
+
+/* Index of the lowest set bit; x must be non-zero */
+inline unsigned Count_trailing_zeros(uint64_t x)
+{
+    #ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, x);
+        return (unsigned)index;
+    #else
+        return (unsigned)__builtin_ctzll(x);
+    #endif
+}
+
+inline unsigned Popcount(uint64_t x)
+{
+    #ifdef _MSC_VER
+        return (unsigned)__popcnt64(x);
+    #else
+        return (unsigned)__builtin_popcountll(x);
+    #endif
+}
+
+/*
+ * Bit-packed binary matrix: element (i,j) is bit (j%64) of word j/64 of
+ * row i. Rows are padded to MATRIX_ALIGN bytes like dense_matrix, and the
+ * unused high bits of the last word of a row are kept at zero.
+ */
+class bit_matrix
+{
+    private:
+        dense_matrix<uint64_t> words;
+        size_t ncols;
 
     public:
+        bit_matrix() : ncols(0) {}
 
-        /* Constructor Functions */
-        RBM();
-        bool Get_netstat();
-        bool Get_ready_to_train();
-        void Set_netstat(bool data);
-        void set_std(double value=0.01);
-        void Set_ready_to_train(bool data);
+        /* Reshapes the matrix; all bits are cleared */
+        void resize(size_t rows, size_t cols)
+        {
+            words.resize(rows, cols/64 + ((cols&63)? 1 : 0));
+            ncols = cols;
+        }
 
-        /* Data Assembling Functions */
-        bool Get_data(matrix_bool &arr,uint16_t nrows);
+        /* Uses external words laid out as above, word_step words between
+           row starts, without copying; the caller keeps them alive */
+        void attach(uint64_t *ptr, size_t rows, size_t cols, size_t word_step)
+        {
+            words.attach(ptr, rows, cols/64 + ((cols&63)? 1 : 0), word_step);
+            ncols = cols;
+        }
 
-        /* Data Display Functions */
-        void Display_data(uint8_t precision = 7, char *notation ="scientific");
-        void Display_error(uint8_t precision = 7, char *notation ="scientific");
-        void Display_weights(uint8_t precision = 7, char *notation ="scientific");
-        void Display_Pos_hidden_activation(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Neg_hidden_activation(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Neg_visible_activation(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Neg_visible_probs(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Neg_hidden_probs(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Pos_hidden_probs(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Neg_associations(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Pos_associations(uint8_t precision=7,
-                                           char *notation ="scientific");
-        void Display_Pos_hidden_States(uint8_t precision=7,
-                                           char *notation ="scientific");
+        void swap(bit_matrix &other)
+        {
+            words.swap(other.words);
+            std::swap(ncols, other.ncols);
+        }
 
-        /* Handle Files */
-        bool Create_file();
-        bool Check_file(const string &name);
+        size_t rows() const { return words.rows(); }
+        size_t bytes() const { return words.bytes(); }
+        size_t cols() const { return ncols; }
+        size_t words_per_row() const { return words.cols(); }
+        size_t word_stride() const { return words.row_stride(); }
+
+        uint64_t *row(size_t i) { return words.row(i); }
+        const uint64_t *row(size_t i) const { return words.row(i); }
+
+        bool get(size_t i, size_t j) const
+        {
+            return (words(i, j>>6) >> (j&63)) & 1;
+        }
+
+        void set(size_t i, size_t j, bool value)
+        {
+            uint64_t mask = (uint64_t)1 << (j&63);
+            uint64_t &word = words(i, j>>6);
+            word = value? (word | mask) : (word & ~mask);
+        }
+
+        /* Number of set bits in the whole matrix */
+        size_t count_ones() const
+        {
+            size_t total = 0;
+            for(size_t i=0;i<rows();++i)
+            {
+                const uint64_t *r = row(i);
+                for(size_t w=0;w<words_per_row();++w)
+                    total += Popcount(r[w]);
+            }
+            return total;
+        }
+};
+
+/*
+ * Compressed sparse row binary matrix: the ones of row i are the column
+ * indices [offsets[i], offsets[i+1]) of the index array, ascending. Every
+ * stored element is 1, so there is no value array. Rows are appended with
+ * add() and end_row(); memory is proportional to the number of ones.
+ */
+class csr_matrix
+{
+    private:
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> indices;
+        size_t ncols;
+
+    public:
+        csr_matrix() : offsets(1, 0), ncols(0) {}
+
+        /* Empties the matrix, keeping the allocated capacity */
+        void clear(size_t cols)
+        {
+            offsets.assign(1, 0);
+            indices.clear();
+            ncols = cols;
+        }
+
+        void reserve(size_t rows, size_t ones)
+        {
+            offsets.reserve(rows+1);
+            indices.reserve(ones);
+        }
+
+        /* Appends a one to the open row; columns must ascend within a row */
+        void add(uint32_t col) { indices.push_back(col); }
+        void end_row() { offsets.push_back(indices.size()); }
+
+        void swap(csr_matrix &other)
+        {
+            offsets.swap(other.offsets);
+            indices.swap(other.indices);
+            std::swap(ncols, other.ncols);
+        }
+
+        size_t rows() const { return offsets.size()-1; }
+        size_t cols() const { return ncols; }
+        size_t count_ones() const { return indices.size(); }
+        size_t bytes() const
+        {
+            return offsets.capacity()*sizeof(uint64_t) + indices.capacity()*sizeof(uint32_t);
+        }
+
+        const uint32_t *row(size_t i) const { return indices.data() + offsets[i]; }
+        size_t row_size(size_t i) const { return (size_t)(offsets[i+1] - offsets[i]); }
+
+        /* Every index in range and strictly ascending within its row */
+        bool valid() const
+        {
+            for(size_t i=0;i<rows();++i)
+            {
+                const uint32_t *r = row(i);
+                for(size_t p=0;p<row_size(i);++p)
+                    if(r[p] >= ncols || (p && r[p] <= r[p-1]))
+                        return false;
+            }
+            return true;
+        }
+};
+
+/*
+ * Non-owning view of a binary matrix in caller memory, trained from in
+ * place by Get_data. Element (i,j) of a VIEW_BOOL or VIEW_UINT8 view is
+ * byte j of row i (non-zero is one); a VIEW_BITS view is laid out like
+ * bit_matrix, 8-byte aligned with the unused high bits of every row zero.
+ */
+enum view_layout
+{
+    VIEW_BOOL,
+    VIEW_UINT8,
+    VIEW_BITS
+};
+
+struct data_view
+{
+    const void *ptr;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t stride;        /* bytes (BOOL, UINT8) or words (BITS) between row starts */
+    view_layout layout;
+};
+
+/* Packs n bytes, non-zero as one, into the low bits first words of out */
+inline void Pack_bytes(const uint8_t *in, size_t n, uint64_t *out)
+{
+    for(size_t w=0;w*64<n;++w)
+    {
+        size_t count = (n - w*64 < 64)? n - w*64 : 64;
+        uint64_t word = 0;
+        for(size_t b=0;b<count;++b)
+            word |= (uint64_t)(in[w*64+b]!= 0) << b;
+        out[w] = word;
+    }
+}
+
+/*
+ * Cache-blocked General Matrix Multiply
+ *
+ *     C = alpha * op(A) * op(B) + beta * C
+ *
+ * op(A) is m x k, op(B) is k x n and C is m x n, all row-major with the
+ * given leading dimensions. Blocking follows the usual Goto scheme: a
+ * KC x NC panel of op(B) is packed to stay in L3, an MC x KC block of
+ * op(A) is packed to stay in L2, and a GEMM_MR x GEMM_NR register tile of
+ * C is accumulated by the micro-kernel. Transposition and conversion of
+ * the operand element type (e.g. binary data) both happen while packing,
+ * so the micro-kernel only ever streams contiguous elements of C's type.
+ */
+#define GEMM_MR 4
+#define GEMM_NR 8
+#define GEMM_NR_FLOAT 16
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+/* Register tile per element type: the float tile is as many vectors wide */
+template <typename T> struct gemm_tile;
+template <> struct gemm_tile<double> { enum { mr = GEMM_MR, nr = GEMM_NR }; };
+template <> struct gemm_tile<float> { enum { mr = GEMM_MR, nr = GEMM_NR_FLOAT }; };
+
+/* Gemm operand: element (i,p) of op(X) for a row-major array of T */
+template <typename T>
+struct gemm_dense_operand
+{
+    const T *ptr;
+    size_t row_step;
+    size_t col_step;
+
+    double at(size_t i, size_t p) const
+    {
+        return (double)ptr[i*row_step + p*col_step];
+    }
+};
+
+/* Gemm operand: element (i,p) of op(X) for a bit-packed binary matrix */
+struct gemm_bit_operand
+{
+    const uint64_t *words;
+    size_t word_stride;
+    bool trans;
+
+    double at(size_t i, size_t p) const
+    {
+        size_t r = trans? p : i;
+        size_t c = trans? i : p;
+        return (double)((words[r*word_stride + (c>>6)] >> (c&63)) & 1);
+    }
+};
+
+/* Packs an mc x kc block of op(A) into GEMM_MR-row slivers, zero padded */
+template <typename T, typename OpA>
+void Gemm_pack_a(const OpA &a, size_t i0, size_t p0,
+                 size_t mc, size_t kc, T *packed)
+{
+    const size_t MR = gemm_tile<T>::mr;
+
+    for(size_t i=0;i<mc;i+=MR)
+    {
+        size_t mr = (mc-i < MR)? mc-i : MR;
+
+        for(size_t p=0;p<kc;++p)
+        {
+            size_t r=0;
+
+            for(;r<mr;++r)
+                packed[r] = (T)a.at(i0+i+r, p0+p);
+            for(;r<MR;++r)
+                packed[r] = 0;
+
+            packed += MR;
+        }
+    }
+}
+
+/* Packs a kc x nc panel of op(B) into NR-column slivers, zero padded */
+template <typename T, typename OpB>
+void Gemm_pack_b(const OpB &b, size_t p0, size_t j0,
+                 size_t kc, size_t nc, T *packed)
+{
+    const size_t NR = gemm_tile<T>::nr;
+
+    for(size_t j=0;j<nc;j+=NR)
+    {
+        size_t nr = (nc-j < NR)? nc-j : NR;
+
+        for(size_t p=0;p<kc;++p)
+        {
+            size_t c=0;
+
+            for(;c<nr;++c)
+                packed[c] = (T)b.at(p0+p, j0+j+c);
+            for(;c<NR;++c)
+                packed[c] = 0;
+
+            packed += NR;
+        }
+    }
+}
+
+/* Writes an accumulated register tile back: C = alpha*acc + beta*C on mr x nr */
+template <typename T>
+inline void Gemm_store_tile(const T *acc, T *c, size_t ldc,
+                            size_t mr, size_t nr, T alpha, T beta)
+{
+    for(size_t i=0;i<mr;++i)
+    {
+        T *cr = c + i*ldc;
+        const T *ar = acc + i*gemm_tile<T>::nr;
+
+        if(beta == 0)
+        {
+            for(size_t j=0;j<nr;++j)
+                cr[j] = alpha*ar[j];
+        }
+        else
+        {
+            for(size_t j=0;j<nr;++j)
+                cr[j] = alpha*ar[j] + beta*cr[j];
+        }
+    }
+}
+
+/* MR x NR register tile: C = alpha*A*B + beta*C on mr x nr */
+template <typename T>
+inline void Gemm_micro_kernel(size_t kc, const T *a, const T *b,
+                              T *c, size_t ldc, size_t mr, size_t nr,
+                              T alpha, T beta)
+{
+    const size_t MR = gemm_tile<T>::mr;
+    const size_t NR = gemm_tile<T>::nr;
+    T acc[MR*NR];
+
+    for(size_t i=0;i<MR*NR;++i)
+        acc[i] = 0;
+
+    for(size_t p=0;p<kc;++p)
+    {
+        for(size_t i=0;i<MR;++i)
+        {
+            const T ai = a[i];
+            for(size_t j=0;j<NR;++j)
+                acc[i*NR+j] += ai*b[j];
+        }
+        a += MR;
+        b += NR;
+    }
+
+    Gemm_store_tile(acc, c, ldc, mr, nr, alpha, beta);
+}
+
+/*
+ * SIMD Kernels
+ *
+ * Every hot elementwise kernel has a scalar, SSE4.2, AVX2 and AVX-512
+ * variant for double and float; Simd<T>() picks the widest one the CPU
+ * and OS support the first time it is called (CPUID + XGETBV). Setting
+ * the environment variable RBM_SIMD to "scalar", "sse4.2", "avx2" or
+ * "avx512" caps the selection.
+ *
+ * Logistic error bound: the vector exp reduces x = n*ln(2) + r with
+ * |r| <= ln(2)/2 and evaluates e^r with a degree-12 Taylor polynomial
+ * (truncation error < 2e-16). Inputs are clamped to [-708, 708]. Against
+ * 1.0/(1.0+std::exp(-x)) the vector sigmoid has relative error below
+ * 4e-16 (about 3 ulp) for every x in [-708, 708]; outside that range it
+ * saturates to 0/1 with absolute error < 1e-307. The float exp uses a
+ * degree-7 polynomial (truncation error < 3e-9) on inputs clamped to
+ * [-87, 87], so the float sigmoid stays within a few float ulp.
+ */
+enum simd_level
+{
+    SIMD_SCALAR = 0,
+    SIMD_SSE42  = 1,
+    SIMD_AVX2   = 2,
+    SIMD_AVX512 = 3
+};
+
+template <typename T>
+struct simd_kernels
+{
+    simd_level level;
+    const char *name;
+
+    /* y[i] = 1/(1+exp(-x[i])) for i < n. At every level NaN stays NaN and
+       x below -EXP_CLAMP (-EXPF_CLAMP in float) gives exactly 0 */
+    void (*logistic)(const T *x, T *y, size_t n);
+    /* bit i of bits = (p[i] > u[i]) for i < n; ceil(n/64) words written */
+    void (*sample)(const T *p, const T *u, size_t n, uint64_t *bits);
+    /* y[i] += x[i] for i < n */
+    void (*accumulate)(const T *x, T *y, size_t n);
+    /* n uniforms in [0,1) from Philox4x32-10 blocks ctr, ctr+1, ... (see Philox_block) */
+    void (*uniform)(const uint32_t key[2], const uint32_t ctr[4], T *out, size_t n);
+    /* Gemm register tile, see Gemm_micro_kernel */
+    void (*gemm_kernel)(size_t kc, const T *a, const T *b,
+                        T *c, size_t ldc, size_t mr, size_t nr,
+                        T alpha, T beta);
+};
+
+/* Inputs of the SIMD exp are clamped to +-EXP_CLAMP (+-EXPF_CLAMP in float) */
+#define EXP_CLAMP   708.0
+#define EXPF_CLAMP   87.0f
+
+template <typename T>
+static void Logistic_scalar(const T *x, T *y, size_t n)
+{
+    /* Below the clamp the SIMD kernels give 0; the scalar tail agrees */
+    const double low = (sizeof(T) == sizeof(float))? -EXPF_CLAMP : -EXP_CLAMP;
+
+    for(size_t i=0;i<n;++i)
+        y[i] = (x[i] < low)? (T)0 : (T)(1.0/(1.0+exp(-(double)x[i])));
+}
+
+template <typename T>
+static void Sample_scalar(const T *p, const T *u, size_t n, uint64_t *bits)
+{
+    for(size_t w=0;w*64<n;++w)
+    {
+        uint64_t word = 0;
+        size_t end = (n-w*64 < 64)? n-w*64 : 64;
+
+        for(size_t j=0;j<end;++j)
+            word |= (uint64_t)(p[w*64+j] > u[w*64+j]) << j;
+        bits[w] = word;
+    }
+}
+
+template <typename T>
+static void Accumulate_scalar(const T *x, T *y, size_t n)
+{
+    for(size_t i=0;i<n;++i)
+        y[i] += x[i];
+}
+
+/*
+ * Philox4x32-10 counter-based generator (Salmon et al., SC'11): a 128-bit
+ * counter is encrypted under a 64-bit key by ten multiply/xor rounds, so
+ * any element of any stream can be produced independently. Each block
+ * yields two doubles with 52 random mantissa bits, built identically by
+ * every SIMD variant so results do not depend on the CPU.
+ */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+inline void Philox_block(const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4])
+{
+    uint32_t x0 = ctr[0], x1 = ctr[1], x2 = ctr[2], x3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for(int r=0;r<10;++r)
+    {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * x0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * x2;
+
+        x0 = (uint32_t)(p1 >> 32) ^ x1 ^ k0;
+        x1 = (uint32_t)p1;
+        x2 = (uint32_t)(p0 >> 32) ^ x3 ^ k1;
+        x3 = (uint32_t)p0;
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    out[0] = x0; out[1] = x1; out[2] = x2; out[3] = x3;
+}
+
+/* Maps 64 random bits to [0,1): top 52 bits as the mantissa of [1,2), minus 1 */
+inline double Bits_to_uniform(uint32_t lo, uint32_t hi)
+{
+    uint64_t bits = 0x3FF0000000000000ull | ((((uint64_t)hi << 32) | lo) >> 12);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d - 1.0;
+}
+
+static void Uniform_scalar(const uint32_t key[2], const uint32_t ctr[4], double *out, size_t n)
+{
+    uint32_t c[4] = { ctr[0], ctr[1], ctr[2], ctr[3] };
+    uint32_t r[4];
+
+    for(size_t i=0;i<n;i+=2, ++c[0])
+    {
+        Philox_block(key, c, r);
+        out[i] = Bits_to_uniform(r[0], r[1]);
+        if(i+1 < n)
+            out[i+1] = Bits_to_uniform(r[2], r[3]);
+    }
+}
+
+/* Float uniforms are the double stream rounded down into [0,1), so both
+   precisions sample with the same noise */
+template <void (*Uniform)(const uint32_t *, const uint32_t *, double *, size_t)>
+static void Uniform_float(const uint32_t key[2], const uint32_t ctr[4], float *out, size_t n)
+{
+    double chunk[64];
+    uint32_t c[4] = { ctr[0], ctr[1], ctr[2], ctr[3] };
+
+    for(size_t i=0;i<n;i+=64, c[0]+=32)
+    {
+        size_t len = (n-i < 64)? n-i : 64;
+        Uniform(key, c, chunk, len);
+
+        for(size_t j=0;j<len;++j)
+        {
+            float f = (float)chunk[j];
+            out[i+j] = (f < 1.0f)? f : 0.99999994f;
+        }
+    }
+}
+
+template <typename T>
+static void Gemm_kernel_scalar(size_t kc, const T *a, const T *b,
+                               T *c, size_t ldc, size_t mr, size_t nr,
+                               T alpha, T beta)
+{
+    Gemm_micro_kernel(kc, a, b, c, ldc, mr, nr, alpha, beta);
+}
+
+/* Coefficients of the exp polynomial and the Cody-Waite split of ln(2) */
+#define EXP_LOG2E   1.4426950408889634
+#define EXP_LN2_HI  6.93147180369123816490e-01
+#define EXP_LN2_LO  1.90821492927058770002e-10
+
+static const double exp_coeffs[13] =
+{
+    1.0, 1.0, 1.0/2, 1.0/6, 1.0/24, 1.0/120, 1.0/720, 1.0/5040,
+    1.0/40320, 1.0/362880, 1.0/3628800, 1.0/39916800, 1.0/479001600
+};
+
+#define EXPF_LN2_HI  0.693359375f
+#define EXPF_LN2_LO  -2.12194440e-4f
+
+static const float expf_coeffs[8] =
+{
+    1.0f, 1.0f, 1.0f/2, 1.0f/6, 1.0f/24, 1.0f/120, 1.0f/720, 1.0f/5040
+};
+
+#if RBM_X86
+
+RBM_TARGET("sse4.2")
+static inline __m128d Exp_sse42(__m128d x)
+{
+    x = _mm_min_pd(_mm_set1_pd(EXP_CLAMP), _mm_max_pd(_mm_set1_pd(-EXP_CLAMP), x));
+
+    __m128d n = _mm_round_pd(_mm_mul_pd(x, _mm_set1_pd(EXP_LOG2E)),
+                             _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+    __m128d r = _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(EXP_LN2_HI)));
+    r = _mm_sub_pd(r, _mm_mul_pd(n, _mm_set1_pd(EXP_LN2_LO)));
+
+    __m128d p = _mm_set1_pd(exp_coeffs[12]);
+    for(int i=11;i>=0;--i)
+        p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(exp_coeffs[i]));
+
+    __m128i e = _mm_cvtepi32_epi64(_mm_cvtpd_epi32(n));
+    e = _mm_slli_epi64(_mm_add_epi64(e, _mm_set1_epi64x(1023)), 52);
+
+    return _mm_mul_pd(p, _mm_castsi128_pd(e));
+}
+
+RBM_TARGET("sse4.2")
+static void Logistic_sse42(const double *x, double *y, size_t n)
+{
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d low = _mm_set1_pd(-EXP_CLAMP);
+    size_t i=0;
+
+    for(;i+2<=n;i+=2)
+    {
+        __m128d v = _mm_loadu_pd(x+i);
+        __m128d t = Exp_sse42(_mm_sub_pd(_mm_setzero_pd(), v));
+        _mm_storeu_pd(y+i, _mm_andnot_pd(_mm_cmplt_pd(v, low), _mm_div_pd(one, _mm_add_pd(one, t))));
+    }
+
+    Logistic_scalar(x+i, y+i, n-i);
+}
+
+RBM_TARGET("sse4.2")
+static void Sample_sse42(const double *p, const double *u, size_t n, uint64_t *bits)
+{
+    size_t full = n/64;
+
+    for(size_t w=0;w<full;++w)
+    {
+        uint64_t word = 0;
+        const double *pw = p + w*64;
+        const double *uw = u + w*64;
+
+        for(size_t j=0;j<64;j+=2)
+        {
+            __m128d gt = _mm_cmpgt_pd(_mm_loadu_pd(pw+j), _mm_loadu_pd(uw+j));
+            word |= (uint64_t)_mm_movemask_pd(gt) << j;
+        }
+        bits[w] = word;
+    }
+
+    if(n > full*64)
+        Sample_scalar(p+full*64, u+full*64, n-full*64, bits+full);
+}
+
+RBM_TARGET("sse4.2")
+static void Accumulate_sse42(const double *x, double *y, size_t n)
+{
+    size_t i=0;
+    for(;i+2<=n;i+=2)
+        _mm_storeu_pd(y+i, _mm_add_pd(_mm_loadu_pd(y+i), _mm_loadu_pd(x+i)));
+    Accumulate_scalar(x+i, y+i, n-i);
+}
+
+RBM_TARGET("sse4.2")
+static inline __m128 Exp_sse42(__m128 x)
+{
+    x = _mm_min_ps(_mm_set1_ps(EXPF_CLAMP), _mm_max_ps(_mm_set1_ps(-EXPF_CLAMP), x));
+
+    __m128 n = _mm_round_ps(_mm_mul_ps(x, _mm_set1_ps((float)EXP_LOG2E)),
+                            _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(EXPF_LN2_HI)));
+    r = _mm_sub_ps(r, _mm_mul_ps(n, _mm_set1_ps(EXPF_LN2_LO)));
+
+    __m128 p = _mm_set1_ps(expf_coeffs[7]);
+    for(int i=6;i>=0;--i)
+        p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(expf_coeffs[i]));
+
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+RBM_TARGET("sse4.2")
+static void Logistic_sse42(const float *x, float *y, size_t n)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 low = _mm_set1_ps(-EXPF_CLAMP);
+    size_t i=0;
+
+    for(;i+4<=n;i+=4)
+    {
+        __m128 v = _mm_loadu_ps(x+i);
+        __m128 t = Exp_sse42(_mm_sub_ps(_mm_setzero_ps(), v));
+        _mm_storeu_ps(y+i, _mm_andnot_ps(_mm_cmplt_ps(v, low), _mm_div_ps(one, _mm_add_ps(one, t))));
+    }
+
+    Logistic_scalar(x+i, y+i, n-i);
+}
+
+RBM_TARGET("sse4.2")
+static void Sample_sse42(const float *p, const float *u, size_t n, uint64_t *bits)
+{
+    size_t full = n/64;
+
+    for(size_t w=0;w<full;++w)
+    {
+        uint64_t word = 0;
+        const float *pw = p + w*64;
+        const float *uw = u + w*64;
+
+        for(size_t j=0;j<64;j+=4)
+        {
+            __m128 gt = _mm_cmpgt_ps(_mm_loadu_ps(pw+j), _mm_loadu_ps(uw+j));
+            word |= (uint64_t)_mm_movemask_ps(gt) << j;
+        }
+        bits[w] = word;
+    }
+
+    if(n > full*64)
+        Sample_scalar(p+full*64, u+full*64, n-full*64, bits+full);
+}
+
+RBM_TARGET("sse4.2")
+static void Accumulate_sse42(const float *x, float *y, size_t n)
+{
+    size_t i=0;
+    for(;i+4<=n;i+=4)
+        _mm_storeu_ps(y+i, _mm_add_ps(_mm_loadu_ps(y+i), _mm_loadu_ps(x+i)));
+    Accumulate_scalar(x+i, y+i, n-i);
+}
+
+RBM_TARGET("avx2,fma")
+static inline __m256d Exp_avx2(__m256d x)
+{
+    x = _mm256_min_pd(_mm256_set1_pd(EXP_CLAMP), _mm256_max_pd(_mm256_set1_pd(-EXP_CLAMP), x));
+
+    __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(EXP_LOG2E)),
+                                _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(EXP_LN2_HI), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(EXP_LN2_LO), r);
+
+    __m256d p = _mm256_set1_pd(exp_coeffs[12]);
+    for(int i=11;i>=0;--i)
+        p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coeffs[i]));
+
+    __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+    e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+RBM_TARGET("avx2,fma")
+static void Logistic_avx2(const double *x, double *y, size_t n)
+{
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d low = _mm256_set1_pd(-EXP_CLAMP);
+    size_t i=0;
+
+    for(;i+4<=n;i+=4)
+    {
+        __m256d v = _mm256_loadu_pd(x+i);
+        __m256d t = Exp_avx2(_mm256_sub_pd(_mm256_setzero_pd(), v));
+        _mm256_storeu_pd(y+i, _mm256_andnot_pd(_mm256_cmp_pd(v, low, _CMP_LT_OQ), _mm256_div_pd(one, _mm256_add_pd(one, t))));
+    }
+
+    Logistic_scalar(x+i, y+i, n-i);
+}
+
+RBM_TARGET("avx2,fma")
+static void Sample_avx2(const double *p, const double *u, size_t n, uint64_t *bits)
+{
+    size_t full = n/64;
+
+    for(size_t w=0;w<full;++w)
+    {
+        uint64_t word = 0;
+        const double *pw = p + w*64;
+        const double *uw = u + w*64;
+
+        for(size_t j=0;j<64;j+=4)
+        {
+            __m256d gt = _mm256_cmp_pd(_mm256_loadu_pd(pw+j), _mm256_loadu_pd(uw+j), _CMP_GT_OQ);
+            word |= (uint64_t)_mm256_movemask_pd(gt) << j;
+        }
+        bits[w] = word;
+    }
+
+    if(n > full*64)
+        Sample_scalar(p+full*64, u+full*64, n-full*64, bits+full);
+}
+
+RBM_TARGET("avx2,fma")
+static void Accumulate_avx2(const double *x, double *y, size_t n)
+{
+    size_t i=0;
+    for(;i+4<=n;i+=4)
+        _mm256_storeu_pd(y+i, _mm256_add_pd(_mm256_loadu_pd(y+i), _mm256_loadu_pd(x+i)));
+    Accumulate_scalar(x+i, y+i, n-i);
+}
+
+/* Four Philox blocks (counters ctr[0]+0..3) per iteration, one per 64-bit lane */
+RBM_TARGET("avx2,fma")
+static void Uniform_avx2(const uint32_t key[2], const uint32_t ctr[4], double *out, size_t n)
+{
+    const __m256i m0 = _mm256_set1_epi64x(PHILOX_M0);
+    const __m256i m1 = _mm256_set1_epi64x(PHILOX_M1);
+    const __m256i lo32 = _mm256_set1_epi64x(0xFFFFFFFFll);
+    const __m256i one_bits = _mm256_set1_epi64x(0x3FF0000000000000ll);
+    const __m256d one = _mm256_set1_pd(1.0);
+
+    size_t i=0;
+    uint32_t block = ctr[0];
+
+    for(;i+8<=n;i+=8, block+=4)
+    {
+        __m256i x0 = _mm256_add_epi64(_mm256_set1_epi64x(block), _mm256_set_epi64x(3, 2, 1, 0));
+        x0 = _mm256_and_si256(x0, lo32);
+        __m256i x1 = _mm256_set1_epi64x(ctr[1]);
+        __m256i x2 = _mm256_set1_epi64x(ctr[2]);
+        __m256i x3 = _mm256_set1_epi64x(ctr[3]);
+        uint32_t k0 = key[0], k1 = key[1];
+
+        for(int r=0;r<10;++r)
+        {
+            __m256i p0 = _mm256_mul_epu32(x0, m0);
+            __m256i p1 = _mm256_mul_epu32(x2, m1);
+
+            x0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), x1),
+                                  _mm256_set1_epi64x(k0));
+            x1 = _mm256_and_si256(p1, lo32);
+            x2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), x3),
+                                  _mm256_set1_epi64x(k1));
+            x3 = _mm256_and_si256(p0, lo32);
+
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+
+        /* 64 bits per double: (x1:x0) and (x3:x2), top 52 as mantissa */
+        __m256i b01 = _mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(x1, 32), x0), 12);
+        __m256i b23 = _mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(x3, 32), x2), 12);
+        __m256d d01 = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(b01, one_bits)), one);
+        __m256d d23 = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(b23, one_bits)), one);
+
+        /* Block-major order: out = b0.d01, b0.d23, b1.d01, b1.d23, ... */
+        __m256d lo = _mm256_unpacklo_pd(d01, d23);
+        __m256d hi = _mm256_unpackhi_pd(d01, d23);
+        _mm256_storeu_pd(out+i,   _mm256_permute2f128_pd(lo, hi, 0x20));
+        _mm256_storeu_pd(out+i+4, _mm256_permute2f128_pd(lo, hi, 0x31));
+    }
+
+    uint32_t rest[4] = { block, ctr[1], ctr[2], ctr[3] };
+    Uniform_scalar(key, rest, out+i, n-i);
+}
+
+RBM_TARGET("avx2,fma")
+static void Gemm_kernel_avx2(size_t kc, const double *a, const double *b,
+                             double *c, size_t ldc, size_t mr, size_t nr,
+                             double alpha, double beta)
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+
+    for(size_t p=0;p<kc;++p)
+    {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b+4);
+        __m256d ai;
+
+        ai = _mm256_broadcast_sd(a);
+        c00 = _mm256_fmadd_pd(ai, b0, c00); c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a+1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10); c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a+2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20); c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a+3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30); c31 = _mm256_fmadd_pd(ai, b1, c31);
+
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    MATRIX_ALIGNED double acc[GEMM_MR*GEMM_NR];
+    _mm256_store_pd(acc,    c00); _mm256_store_pd(acc+4,  c01);
+    _mm256_store_pd(acc+8,  c10); _mm256_store_pd(acc+12, c11);
+    _mm256_store_pd(acc+16, c20); _mm256_store_pd(acc+20, c21);
+    _mm256_store_pd(acc+24, c30); _mm256_store_pd(acc+28, c31);
+
+    Gemm_store_tile(acc, c, ldc, mr, nr, alpha, beta);
+}
+
+RBM_TARGET("avx2,fma")
+static inline __m256 Exp_avx2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_set1_ps(EXPF_CLAMP), _mm256_max_ps(_mm256_set1_ps(-EXPF_CLAMP), x));
+
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps((float)EXP_LOG2E)),
+                               _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(EXPF_LN2_HI), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(EXPF_LN2_LO), r);
+
+    __m256 p = _mm256_set1_ps(expf_coeffs[7]);
+    for(int i=6;i>=0;--i)
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(expf_coeffs[i]));
+
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+RBM_TARGET("avx2,fma")
+static void Logistic_avx2(const float *x, float *y, size_t n)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 low = _mm256_set1_ps(-EXPF_CLAMP);
+    size_t i=0;
+
+    for(;i+8<=n;i+=8)
+    {
+        __m256 v = _mm256_loadu_ps(x+i);
+        __m256 t = Exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), v));
+        _mm256_storeu_ps(y+i, _mm256_andnot_ps(_mm256_cmp_ps(v, low, _CMP_LT_OQ), _mm256_div_ps(one, _mm256_add_ps(one, t))));
+    }
+
+    Logistic_scalar(x+i, y+i, n-i);
+}
+
+RBM_TARGET("avx2,fma")
+static void Sample_avx2(const float *p, const float *u, size_t n, uint64_t *bits)
+{
+    size_t full = n/64;
+
+    for(size_t w=0;w<full;++w)
+    {
+        uint64_t word = 0;
+        const float *pw = p + w*64;
+        const float *uw = u + w*64;
+
+        for(size_t j=0;j<64;j+=8)
+        {
+            __m256 gt = _mm256_cmp_ps(_mm256_loadu_ps(pw+j), _mm256_loadu_ps(uw+j), _CMP_GT_OQ);
+            word |= (uint64_t)_mm256_movemask_ps(gt) << j;
+        }
+        bits[w] = word;
+    }
+
+    if(n > full*64)
+        Sample_scalar(p+full*64, u+full*64, n-full*64, bits+full);
+}
+
+RBM_TARGET("avx2,fma")
+static void Accumulate_avx2(const float *x, float *y, size_t n)
+{
+    size_t i=0;
+    for(;i+8<=n;i+=8)
+        _mm256_storeu_ps(y+i, _mm256_add_ps(_mm256_loadu_ps(y+i), _mm256_loadu_ps(x+i)));
+    Accumulate_scalar(x+i, y+i, n-i);
+}
+
+RBM_TARGET("avx2,fma")
+static void Gemm_kernel_avx2(size_t kc, const float *a, const float *b,
+                             float *c, size_t ldc, size_t mr, size_t nr,
+                             float alpha, float beta)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+
+    for(size_t p=0;p<kc;++p)
+    {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b+8);
+        __m256 ai;
+
+        ai = _mm256_broadcast_ss(a);
+        c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a+1);
+        c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a+2);
+        c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a+3);
+        c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+
+        a += GEMM_MR;
+        b += GEMM_NR_FLOAT;
+    }
+
+    MATRIX_ALIGNED float acc[GEMM_MR*GEMM_NR_FLOAT];
+    _mm256_store_ps(acc,    c00); _mm256_store_ps(acc+8,  c01);
+    _mm256_store_ps(acc+16, c10); _mm256_store_ps(acc+24, c11);
+    _mm256_store_ps(acc+32, c20); _mm256_store_ps(acc+40, c21);
+    _mm256_store_ps(acc+48, c30); _mm256_store_ps(acc+56, c31);
+
+    Gemm_store_tile(acc, c, ldc, mr, nr, alpha, beta);
+}
+
+/* GCC 12 flags _mm512_undefined_pd() inside its own headers */
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+RBM_TARGET("avx512f")
+static inline __m512d Exp_avx512(__m512d x)
+{
+    x = _mm512_min_pd(_mm512_set1_pd(EXP_CLAMP), _mm512_max_pd(_mm512_set1_pd(-EXP_CLAMP), x));
+
+    __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(EXP_LOG2E)),
+                                     _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+    __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(EXP_LN2_HI), x);
+    r = _mm512_fnmadd_pd(n, _mm512_set1_pd(EXP_LN2_LO), r);
+
+    __m512d p = _mm512_set1_pd(exp_coeffs[12]);
+    for(int i=11;i>=0;--i)
+        p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_coeffs[i]));
+
+    return _mm512_scalef_pd(p, n);
+}
+
+RBM_TARGET("avx512f")
+static void Logistic_avx512(const double *x, double *y, size_t n)
+{
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d low = _mm512_set1_pd(-EXP_CLAMP);
+    size_t i=0;
+
+    for(;i+8<=n;i+=8)
+    {
+        __m512d v = _mm512_loadu_pd(x+i);
+        __m512d t = Exp_avx512(_mm512_sub_pd(_mm512_setzero_pd(), v));
+        __mmask8 keep = _mm512_cmp_pd_mask(v, low, _CMP_NLT_UQ);
+        _mm512_storeu_pd(y+i, _mm512_maskz_div_pd(keep, one, _mm512_add_pd(one, t)));
+    }
+
+    if(i < n)
+    {
+        __mmask8 tail = (__mmask8)((1u << (n-i)) - 1);
+        __m512d v = _mm512_maskz_loadu_pd(tail, x+i);
+        __m512d t = Exp_avx512(_mm512_sub_pd(_mm512_setzero_pd(), v));
+        __mmask8 keep = _mm512_cmp_pd_mask(v, low, _CMP_NLT_UQ);
+        _mm512_mask_storeu_pd(y+i, tail, _mm512_maskz_div_pd(keep, one, _mm512_add_pd(one, t)));
+    }
+}
+
+RBM_TARGET("avx512f")
+static void Sample_avx512(const double *p, const double *u, size_t n, uint64_t *bits)
+{
+    for(size_t w=0;w*64<n;++w)
+    {
+        uint64_t word = 0;
+        size_t end = (n-w*64 < 64)? n-w*64 : 64;
+        const double *pw = p + w*64;
+        const double *uw = u + w*64;
+
+        for(size_t j=0;j<end;j+=8)
+        {
+            __mmask8 live = (end-j >= 8)? (__mmask8)0xFF : (__mmask8)((1u << (end-j)) - 1);
+            __mmask8 gt = _mm512_mask_cmp_pd_mask(live, _mm512_maskz_loadu_pd(live, pw+j),
+                                                  _mm512_maskz_loadu_pd(live, uw+j), _CMP_GT_OQ);
+            word |= (uint64_t)gt << j;
+        }
+        bits[w] = word;
+    }
+}
+
+RBM_TARGET("avx512f")
+static void Accumulate_avx512(const double *x, double *y, size_t n)
+{
+    size_t i=0;
+    for(;i+8<=n;i+=8)
+        _mm512_storeu_pd(y+i, _mm512_add_pd(_mm512_loadu_pd(y+i), _mm512_loadu_pd(x+i)));
+
+    if(i < n)
+    {
+        __mmask8 tail = (__mmask8)((1u << (n-i)) - 1);
+        _mm512_mask_storeu_pd(y+i, tail, _mm512_add_pd(_mm512_maskz_loadu_pd(tail, y+i),
+                                                       _mm512_maskz_loadu_pd(tail, x+i)));
+    }
+}
+
+/* Eight Philox blocks per iteration, one per 64-bit lane */
+RBM_TARGET("avx512f")
+static void Uniform_avx512(const uint32_t key[2], const uint32_t ctr[4], double *out, size_t n)
+{
+    const __m512i m0 = _mm512_set1_epi64(PHILOX_M0);
+    const __m512i m1 = _mm512_set1_epi64(PHILOX_M1);
+    const __m512i lo32 = _mm512_set1_epi64(0xFFFFFFFFll);
+    const __m512i one_bits = _mm512_set1_epi64(0x3FF0000000000000ll);
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512i first_half = _mm512_set_epi64(11, 3, 10, 2, 9, 1, 8, 0);
+    const __m512i second_half = _mm512_set_epi64(15, 7, 14, 6, 13, 5, 12, 4);
+
+    size_t i=0;
+    uint32_t block = ctr[0];
+
+    for(;i+16<=n;i+=16, block+=8)
+    {
+        __m512i x0 = _mm512_add_epi64(_mm512_set1_epi64(block), _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0));
+        x0 = _mm512_and_si512(x0, lo32);
+        __m512i x1 = _mm512_set1_epi64(ctr[1]);
+        __m512i x2 = _mm512_set1_epi64(ctr[2]);
+        __m512i x3 = _mm512_set1_epi64(ctr[3]);
+        uint32_t k0 = key[0], k1 = key[1];
+
+        for(int r=0;r<10;++r)
+        {
+            __m512i p0 = _mm512_mul_epu32(x0, m0);
+            __m512i p1 = _mm512_mul_epu32(x2, m1);
+
+            x0 = _mm512_xor_si512(_mm512_xor_si512(_mm512_srli_epi64(p1, 32), x1),
+                                  _mm512_set1_epi64(k0));
+            x1 = _mm512_and_si512(p1, lo32);
+            x2 = _mm512_xor_si512(_mm512_xor_si512(_mm512_srli_epi64(p0, 32), x3),
+                                  _mm512_set1_epi64(k1));
+            x3 = _mm512_and_si512(p0, lo32);
+
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+
+        __m512i b01 = _mm512_srli_epi64(_mm512_or_si512(_mm512_slli_epi64(x1, 32), x0), 12);
+        __m512i b23 = _mm512_srli_epi64(_mm512_or_si512(_mm512_slli_epi64(x3, 32), x2), 12);
+        __m512d d01 = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(b01, one_bits)), one);
+        __m512d d23 = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(b23, one_bits)), one);
+
+        _mm512_storeu_pd(out+i,   _mm512_permutex2var_pd(d01, first_half, d23));
+        _mm512_storeu_pd(out+i+8, _mm512_permutex2var_pd(d01, second_half, d23));
+    }
+
+    uint32_t rest[4] = { block, ctr[1], ctr[2], ctr[3] };
+    Uniform_scalar(key, rest, out+i, n-i);
+}
+
+RBM_TARGET("avx512f")
+static void Gemm_kernel_avx512(size_t kc, const double *a, const double *b,
+                               double *c, size_t ldc, size_t mr, size_t nr,
+                               double alpha, double beta)
+{
+    __m512d c0 = _mm512_setzero_pd(), c1 = _mm512_setzero_pd();
+    __m512d c2 = _mm512_setzero_pd(), c3 = _mm512_setzero_pd();
+
+    for(size_t p=0;p<kc;++p)
+    {
+        __m512d bp = _mm512_load_pd(b);
+
+        c0 = _mm512_fmadd_pd(_mm512_set1_pd(a[0]), bp, c0);
+        c1 = _mm512_fmadd_pd(_mm512_set1_pd(a[1]), bp, c1);
+        c2 = _mm512_fmadd_pd(_mm512_set1_pd(a[2]), bp, c2);
+        c3 = _mm512_fmadd_pd(_mm512_set1_pd(a[3]), bp, c3);
+
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    MATRIX_ALIGNED double acc[GEMM_MR*GEMM_NR];
+    _mm512_store_pd(acc,    c0);
+    _mm512_store_pd(acc+8,  c1);
+    _mm512_store_pd(acc+16, c2);
+    _mm512_store_pd(acc+24, c3);
+
+    Gemm_store_tile(acc, c, ldc, mr, nr, alpha, beta);
+}
+
+RBM_TARGET("avx512f")
+static inline __m512 Exp_avx512(__m512 x)
+{
+    x = _mm512_min_ps(_mm512_set1_ps(EXPF_CLAMP), _mm512_max_ps(_mm512_set1_ps(-EXPF_CLAMP), x));
+
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps((float)EXP_LOG2E)),
+                                    _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(EXPF_LN2_HI), x);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(EXPF_LN2_LO), r);
+
+    __m512 p = _mm512_set1_ps(expf_coeffs[7]);
+    for(int i=6;i>=0;--i)
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(expf_coeffs[i]));
+
+    return _mm512_scalef_ps(p, n);
+}
+
+RBM_TARGET("avx512f")
+static void Logistic_avx512(const float *x, float *y, size_t n)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 low = _mm512_set1_ps(-EXPF_CLAMP);
+    size_t i=0;
+
+    for(;i+16<=n;i+=16)
+    {
+        __m512 v = _mm512_loadu_ps(x+i);
+        __m512 t = Exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), v));
+        __mmask16 keep = _mm512_cmp_ps_mask(v, low, _CMP_NLT_UQ);
+        _mm512_storeu_ps(y+i, _mm512_maskz_div_ps(keep, one, _mm512_add_ps(one, t)));
+    }
+
+    if(i < n)
+    {
+        __mmask16 tail = (__mmask16)((1u << (n-i)) - 1);
+        __m512 v = _mm512_maskz_loadu_ps(tail, x+i);
+        __m512 t = Exp_avx512(_mm512_sub_ps(_mm512_setzero_ps(), v));
+        __mmask16 keep = _mm512_cmp_ps_mask(v, low, _CMP_NLT_UQ);
+        _mm512_mask_storeu_ps(y+i, tail, _mm512_maskz_div_ps(keep, one, _mm512_add_ps(one, t)));
+    }
+}
+
+RBM_TARGET("avx512f")
+static void Sample_avx512(const float *p, const float *u, size_t n, uint64_t *bits)
+{
+    for(size_t w=0;w*64<n;++w)
+    {
+        uint64_t word = 0;
+        size_t end = (n-w*64 < 64)? n-w*64 : 64;
+        const float *pw = p + w*64;
+        const float *uw = u + w*64;
+
+        for(size_t j=0;j<end;j+=16)
+        {
+            __mmask16 live = (end-j >= 16)? (__mmask16)0xFFFF : (__mmask16)((1u << (end-j)) - 1);
+            __mmask16 gt = _mm512_mask_cmp_ps_mask(live, _mm512_maskz_loadu_ps(live, pw+j),
+                                                   _mm512_maskz_loadu_ps(live, uw+j), _CMP_GT_OQ);
+            word |= (uint64_t)gt << j;
+        }
+        bits[w] = word;
+    }
+}
+
+RBM_TARGET("avx512f")
+static void Accumulate_avx512(const float *x, float *y, size_t n)
+{
+    size_t i=0;
+    for(;i+16<=n;i+=16)
+        _mm512_storeu_ps(y+i, _mm512_add_ps(_mm512_loadu_ps(y+i), _mm512_loadu_ps(x+i)));
+
+    if(i < n)
+    {
+        __mmask16 tail = (__mmask16)((1u << (n-i)) - 1);
+        _mm512_mask_storeu_ps(y+i, tail, _mm512_add_ps(_mm512_maskz_loadu_ps(tail, y+i),
+                                                       _mm512_maskz_loadu_ps(tail, x+i)));
+    }
+}
+
+RBM_TARGET("avx512f")
+static void Gemm_kernel_avx512(size_t kc, const float *a, const float *b,
+                               float *c, size_t ldc, size_t mr, size_t nr,
+                               float alpha, float beta)
+{
+    __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps();
+    __m512 c2 = _mm512_setzero_ps(), c3 = _mm512_setzero_ps();
+
+    for(size_t p=0;p<kc;++p)
+    {
+        __m512 bp = _mm512_load_ps(b);
+
+        c0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), bp, c0);
+        c1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), bp, c1);
+        c2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), bp, c2);
+        c3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), bp, c3);
+
+        a += GEMM_MR;
+        b += GEMM_NR_FLOAT;
+    }
+
+    MATRIX_ALIGNED float acc[GEMM_MR*GEMM_NR_FLOAT];
+    _mm512_store_ps(acc,    c0);
+    _mm512_store_ps(acc+16, c1);
+    _mm512_store_ps(acc+32, c2);
+    _mm512_store_ps(acc+48, c3);
+
+    Gemm_store_tile(acc, c, ldc, mr, nr, alpha, beta);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic pop
+#endif
+
+static void Cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+    #ifdef _MSC_VER
+        __cpuidex((int *)regs, (int)leaf, (int)subleaf);
+    #else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+    #endif
+}
+
+static uint64_t Xgetbv()
+{
+    #ifdef _MSC_VER
+        return _xgetbv(0);
+    #else
+        uint32_t lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        return ((uint64_t)hi << 32) | lo;
+    #endif
+}
+
+static simd_level Detect_simd_level()
+{
+    unsigned regs[4] = {0, 0, 0, 0};
+    simd_level level = SIMD_SCALAR;
+
+    Cpuid(0, 0, regs);
+    unsigned max_leaf = regs[0];
+
+    Cpuid(1, 0, regs);
+    bool sse42   = (regs[2] >> 20) & 1;
+    bool fma     = (regs[2] >> 12) & 1;
+    bool osxsave = (regs[2] >> 27) & 1;
+    bool avx     = (regs[2] >> 28) & 1;
+
+    if(sse42)
+        level = SIMD_SSE42;
+
+    if(!(osxsave && avx) || max_leaf < 7)
+        return level;
+
+    uint64_t xcr0 = Xgetbv();
+    Cpuid(7, 0, regs);
+
+    /* XMM and YMM state enabled by the OS */
+    if((xcr0 & 0x6) == 0x6 && fma && ((regs[1] >> 5) & 1))
+        level = SIMD_AVX2;
+
+    /* Opmask, ZMM_Hi256 and Hi16_ZMM state enabled as well */
+    if((xcr0 & 0xE6) == 0xE6 && ((regs[1] >> 16) & 1) && level == SIMD_AVX2)
+        level = SIMD_AVX512;
+
+    return level;
+}
+
+#else
+
+static simd_level Detect_simd_level()
+{
+    return SIMD_SCALAR;
+}
+
+#endif // RBM_X86
+
+static simd_level Select_simd_level()
+{
+    simd_level level = Detect_simd_level();
+
+    const char *cap = getenv("RBM_SIMD");
+    if(cap)
+    {
+        simd_level limit = SIMD_AVX512;
+        if(!strcmp(cap,"scalar"))
+            limit = SIMD_SCALAR;
+        else if(!strcmp(cap,"sse4.2"))
+            limit = SIMD_SSE42;
+        else if(!strcmp(cap,"avx2"))
+            limit = SIMD_AVX2;
+
+        if(limit < level)
+            level = limit;
+    }
+
+    return level;
+}
+
+static void Select_simd_kernels(simd_level level, simd_kernels<double> &k)
+{
+    simd_kernels<double> scalar = { SIMD_SCALAR, "scalar", Logistic_scalar, Sample_scalar,
+                                    Accumulate_scalar, Uniform_scalar, Gemm_kernel_scalar };
+    k = scalar;
+
+    #if RBM_X86
+        if(level == SIMD_SSE42)
+        {
+            simd_kernels<double> sse = { SIMD_SSE42, "sse4.2", Logistic_sse42, Sample_sse42,
+                                         Accumulate_sse42, Uniform_scalar, Gemm_kernel_scalar };
+            k = sse;
+        }
+        else if(level == SIMD_AVX2)
+        {
+            simd_kernels<double> avx2 = { SIMD_AVX2, "avx2", Logistic_avx2, Sample_avx2,
+                                          Accumulate_avx2, Uniform_avx2, Gemm_kernel_avx2 };
+            k = avx2;
+        }
+        else if(level == SIMD_AVX512)
+        {
+            simd_kernels<double> avx512 = { SIMD_AVX512, "avx512", Logistic_avx512, Sample_avx512,
+                                            Accumulate_avx512, Uniform_avx512, Gemm_kernel_avx512 };
+            k = avx512;
+        }
+    #endif // RBM_X86
+}
+
+static void Select_simd_kernels(simd_level level, simd_kernels<float> &k)
+{
+    simd_kernels<float> scalar = { SIMD_SCALAR, "scalar", Logistic_scalar, Sample_scalar,
+                                   Accumulate_scalar, Uniform_float<Uniform_scalar>,
+                                   Gemm_kernel_scalar };
+    k = scalar;
+
+    #if RBM_X86
+        if(level == SIMD_SSE42)
+        {
+            simd_kernels<float> sse = { SIMD_SSE42, "sse4.2", Logistic_sse42, Sample_sse42,
+                                        Accumulate_sse42, Uniform_float<Uniform_scalar>,
+                                        Gemm_kernel_scalar };
+            k = sse;
+        }
+        else if(level == SIMD_AVX2)
+        {
+            simd_kernels<float> avx2 = { SIMD_AVX2, "avx2", Logistic_avx2, Sample_avx2,
+                                         Accumulate_avx2, Uniform_float<Uniform_avx2>,
+                                         Gemm_kernel_avx2 };
+            k = avx2;
+        }
+        else if(level == SIMD_AVX512)
+        {
+            simd_kernels<float> avx512 = { SIMD_AVX512, "avx512", Logistic_avx512, Sample_avx512,
+                                           Accumulate_avx512, Uniform_float<Uniform_avx512>,
+                                           Gemm_kernel_avx512 };
+            k = avx512;
+        }
+    #endif // RBM_X86
+}
+
+template <typename T>
+static simd_kernels<T> Load_simd_kernels()
+{
+    simd_kernels<T> k;
+    Select_simd_kernels(Select_simd_level(), k);
+    return k;
+}
+
+/* Kernel table of element type T for this CPU, selected once on first use */
+template <typename T = double>
+inline const simd_kernels<T> &Simd()
+{
+    static const simd_kernels<T> kernels = Load_simd_kernels<T>();
+    return kernels;
+}
+
+/* Packing buffers, one pair per thread and element type */
+template <typename T>
+struct gemm_workspace
+{
+    dense_matrix<T> packed_a;
+    dense_matrix<T> packed_b;
+
+    gemm_workspace()
+    {
+        packed_a.resize(1, GEMM_MC*GEMM_KC);
+        packed_b.resize(1, GEMM_KC*GEMM_NC);
+    }
+};
+
+template <typename T, typename OpA, typename OpB>
+void Gemm_blocked(size_t m, size_t n, size_t k, T alpha,
+                  const OpA &a, const OpB &b, T beta, T *c, size_t ldc)
+{
+    static thread_local gemm_workspace<T> workspace;
+    const simd_kernels<T> &simd = Simd<T>();
+    const size_t MR = gemm_tile<T>::mr;
+    const size_t NR = gemm_tile<T>::nr;
+
+    if(m == 0 || n == 0)
+        return;
+
+    if(k == 0)
+    {
+        for(size_t i=0;i<m;++i)
+            for(size_t j=0;j<n;++j)
+                c[i*ldc+j] = (beta == 0)? 0 : beta*c[i*ldc+j];
+        return;
+    }
+
+    T *packed_a = workspace.packed_a.data();
+    T *packed_b = workspace.packed_b.data();
+
+    for(size_t jc=0;jc<n;jc+=GEMM_NC)
+    {
+        size_t nc = (n-jc < GEMM_NC)? n-jc : GEMM_NC;
+
+        for(size_t pc=0;pc<k;pc+=GEMM_KC)
+        {
+            size_t kc = (k-pc < GEMM_KC)? k-pc : GEMM_KC;
+            T beta_block = (pc == 0)? beta : 1;
+
+            Gemm_pack_b(b, pc, jc, kc, nc, packed_b);
+
+            for(size_t ic=0;ic<m;ic+=GEMM_MC)
+            {
+                size_t mc = (m-ic < GEMM_MC)? m-ic : GEMM_MC;
+
+                Gemm_pack_a(a, ic, pc, mc, kc, packed_a);
+
+                for(size_t jr=0;jr<nc;jr+=NR)
+                {
+                    size_t nr = (nc-jr < NR)? nc-jr : NR;
+
+                    for(size_t ir=0;ir<mc;ir+=MR)
+                    {
+                        size_t mr = (mc-ir < MR)? mc-ir : MR;
+
+                        simd.gemm_kernel(kc, packed_a + ir*kc, packed_b + jr*kc,
+                                         c + (ic+ir)*ldc + jc+jr, ldc,
+                                         mr, nr, alpha, beta_block);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Dense operands; trans_a/trans_b select op(X) = X^T. C's type sets the precision */
+template <typename TA, typename TB, typename TC>
+void Gemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+          double alpha, const TA *a, size_t lda, const TB *b, size_t ldb,
+          double beta, TC *c, size_t ldc)
+{
+    gemm_dense_operand<TA> op_a = { a, trans_a? 1 : lda, trans_a? lda : 1 };
+    gemm_dense_operand<TB> op_b = { b, trans_b? 1 : ldb, trans_b? ldb : 1 };
+
+    Gemm_blocked(m, n, k, (TC)alpha, op_a, op_b, (TC)beta, c, ldc);
+}
+
+/* Bit-packed binary A operand (starting at row a_first) times dense B operand */
+template <typename TB, typename TC>
+void Gemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+          double alpha, const bit_matrix &a, size_t a_first, const TB *b, size_t ldb,
+          double beta, TC *c, size_t ldc)
+{
+    gemm_bit_operand op_a = { a.row(a_first), a.word_stride(), trans_a };
+    gemm_dense_operand<TB> op_b = { b, trans_b? 1 : ldb, trans_b? ldb : 1 };
+
+    Gemm_blocked(m, n, k, (TC)alpha, op_a, op_b, (TC)beta, c, ldc);
+}
+
+/*
+ * Masked-accumulate kernels for bit-packed binary A operands. Instead of
+ * multiplying every element of A, they walk the set bits of each row
+ * (count-trailing-zeros) and add whole rows, so the work is proportional
+ * to the number of ones rather than to the number of columns.
+ */
+
+/* Rows [0, m) of C = the n-vector bias, the starting point of a Gemm with beta 1 */
+template <typename T>
+inline void Broadcast_rows(size_t m, const T *bias, size_t n, T *c, size_t ldc)
+{
+    for(size_t i=0;i<m;++i)
+        memcpy(c + i*ldc, bias, n*sizeof(T));
+}
+
+/* Density of ones below which the masked kernels beat the bit Gemm. Below
+   it dense data sums the same weight rows in the same order as the CSR
+   kernels, so both train identical weights; above it the Gemm path agrees
+   with CSR input only to rounding */
+#define MASKED_DENSITY_LIMIT 0.25
+
+/* C (m x n) = init + A (m x k bits) * B (k x n): row i of C starts from the n-vector init
+   (zero when NULL) and sums the rows of B selected by row first+i of A */
+template <typename T>
+inline void Masked_row_sum(size_t m, const bit_matrix &a, size_t first, const T *b, size_t ldb,
+                           size_t n, const T *init, T *c, size_t ldc)
+{
+    const simd_kernels<T> &simd = Simd<T>();
+
+    for(size_t i=0;i<m;++i)
+    {
+        const uint64_t *bits = a.row(first+i);
+        T *ci = c + i*ldc;
+
+        if(init)
+            memcpy(ci, init, n*sizeof(T));
+        else
+            memset(ci, 0, n*sizeof(T));
+
+        for(size_t w=0;w<a.words_per_row();++w)
+        {
+            uint64_t word = bits[w];
+            while(word)
+            {
+                size_t z = w*64 + Count_trailing_zeros(word);
+                simd.accumulate(b + z*ldb, ci, n);
+                word &= word-1;
+            }
+        }
+    }
+}
+
+/* C (k x n) = Transpose(A (m x k bits)) * H (m x n): row i of H is added to the rows of C selected by row first+i of A */
+template <typename T>
+inline void Masked_transpose_accumulate(size_t m, const bit_matrix &a, size_t first, const T *h, size_t ldh,
+                                        size_t n, T *c, size_t ldc)
+{
+    const simd_kernels<T> &simd = Simd<T>();
+
+    for(size_t z=0;z<a.cols();++z)
+        memset(c + z*ldc, 0, n*sizeof(T));
+
+    for(size_t i=0;i<m;++i)
+    {
+        const uint64_t *bits = a.row(first+i);
+        const T *hi = h + i*ldh;
+
+        for(size_t w=0;w<a.words_per_row();++w)
+        {
+            uint64_t word = bits[w];
+            while(word)
+            {
+                size_t z = w*64 + Count_trailing_zeros(word);
+                simd.accumulate(hi, c + z*ldc, n);
+                word &= word-1;
+            }
+        }
+    }
+}
+
+/*
+ * Sparse kernels for CSR A operands: the masked kernels above without the
+ * scan over every word of a row, so the work no longer grows with the
+ * number of columns of A, only with its ones.
+ */
+
+/* C (m x n) = init + A (m x k CSR) * B (k x n): row i of C starts from init (zero when
+   NULL) and sums the rows of B listed in row first+i of A */
+template <typename T>
+inline void Sparse_row_sum(size_t m, const csr_matrix &a, size_t first, const T *b, size_t ldb,
+                           size_t n, const T *init, T *c, size_t ldc)
+{
+    const simd_kernels<T> &simd = Simd<T>();
+
+    for(size_t i=0;i<m;++i)
+    {
+        const uint32_t *cols = a.row(first+i);
+        size_t ones = a.row_size(first+i);
+        T *ci = c + i*ldc;
+
+        if(init)
+            memcpy(ci, init, n*sizeof(T));
+        else
+            memset(ci, 0, n*sizeof(T));
+
+        for(size_t p=0;p<ones;++p)
+            simd.accumulate(b + (size_t)cols[p]*ldb, ci, n);
+    }
+}
+
+/* C (k x n) = Transpose(A (m x k CSR)) * H (m x n): row i of H is added to the rows of C listed in row first+i of A */
+template <typename T>
+inline void Sparse_transpose_accumulate(size_t m, const csr_matrix &a, size_t first, const T *h, size_t ldh,
+                                        size_t n, T *c, size_t ldc)
+{
+    const simd_kernels<T> &simd = Simd<T>();
+
+    for(size_t z=0;z<a.cols();++z)
+        memset(c + z*ldc, 0, n*sizeof(T));
+
+    for(size_t i=0;i<m;++i)
+    {
+        const uint32_t *cols = a.row(first+i);
+        size_t ones = a.row_size(first+i);
+        const T *hi = h + i*ldh;
+
+        for(size_t p=0;p<ones;++p)
+            simd.accumulate(hi, c + (size_t)cols[p]*ldc, n);
+    }
+}
+
+/* sum (k) = ones per column of rows [first, first+m) of A, the visible bias gradient */
+template <typename T>
+inline void Column_count(size_t m, const bit_matrix &a, size_t first, T *sum)
+{
+    memset(sum, 0, a.cols()*sizeof(T));
+
+    for(size_t i=0;i<m;++i)
+    {
+        const uint64_t *bits = a.row(first+i);
+        for(size_t w=0;w<a.words_per_row();++w)
+        {
+            uint64_t word = bits[w];
+            while(word)
+            {
+                sum[w*64 + Count_trailing_zeros(word)] += 1;
+                word &= word-1;
+            }
+        }
+    }
+}
+
+template <typename T>
+inline void Column_count(size_t m, const csr_matrix &a, size_t first, T *sum)
+{
+    memset(sum, 0, a.cols()*sizeof(T));
+
+    for(size_t i=0;i<m;++i)
+    {
+        const uint32_t *cols = a.row(first+i);
+        for(size_t p=0;p<a.row_size(first+i);++p)
+            sum[cols[p]] += 1;
+    }
+}
+
+/*
+ * Persistent work-stealing thread pool
+ *
+ * Parallel_for(count, task) runs task(i, worker) for every i < count and
+ * returns when all of them have finished. The calling thread takes part
+ * as worker 0, so a pool of size() participants owns size()-1 threads.
+ * Task indices are dealt round-robin into one deque per participant;
+ * each participant pops from the back of its own deque and, once it is
+ * empty, steals from the front of the others. Threads sleep between
+ * jobs and live as long as the pool. If tasks throw, the rest still run
+ * and the first exception is rethrown to the caller of Parallel_for.
+ */
+class thread_pool
+{
+    public:
+        typedef std::function<void(size_t task, size_t worker)> task_function;
+
+    private:
+        struct task_queue
+        {
+            std::mutex lock;
+            std::deque<size_t> tasks;
+        };
+
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<task_queue> > queues;
+
+        std::mutex job_lock;
+        std::condition_variable job_ready;
+        std::condition_variable job_done;
+
+        const task_function *job;
+        uint64_t generation;
+        std::atomic<size_t> remaining;
+        std::exception_ptr failure;
+        bool stopping;
+
+        bool Pop_task(size_t self, size_t &task)
+        {
+            size_t n = queues.size();
+
+            for(size_t i=0;i<n;++i)
+            {
+                size_t victim = (self+i)%n;
+                task_queue &q = *queues[victim];
+                std::lock_guard<std::mutex> guard(q.lock);
+
+                if(q.tasks.empty())
+                    continue;
+
+                if(victim == self)
+                {
+                    task = q.tasks.back();
+                    q.tasks.pop_back();
+                }
+                else
+                {
+                    task = q.tasks.front();
+                    q.tasks.pop_front();
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void Run_tasks(size_t self)
+        {
+            size_t task;
+
+            while(Pop_task(self, task))
+            {
+                /* A throwing task still counts as done; the first exception
+                   is rethrown by Parallel_for on the calling thread */
+                try
+                {
+                    (*job)(task, self);
+                }
+                catch(...)
+                {
+                    std::lock_guard<std::mutex> guard(job_lock);
+                    if(!failure)
+                        failure = std::current_exception();
+                }
+
+                if(remaining.fetch_sub(1) == 1)
+                {
+                    std::lock_guard<std::mutex> guard(job_lock);
+                    job_done.notify_all();
+                }
+            }
+        }
+
+        void Worker_loop(size_t self)
+        {
+            uint64_t seen = 0;
+
+            for(;;)
+            {
+                {
+                    std::unique_lock<std::mutex> guard(job_lock);
+                    job_ready.wait(guard, [&]{ return stopping || generation != seen; });
+
+                    if(stopping)
+                        return;
+                    seen = generation;
+                }
+
+                Run_tasks(self);
+            }
+        }
+
+    public:
+        explicit thread_pool(unsigned participants = 1)
+            : job(NULL), generation(0), remaining(0), stopping(false)
+        {
+            if(participants == 0)
+                participants = 1;
+
+            for(unsigned i=0;i<participants;++i)
+                queues.push_back(std::unique_ptr<task_queue>(new task_queue));
+
+            for(unsigned i=1;i<participants;++i)
+                threads.push_back(std::thread(&thread_pool::Worker_loop, this, (size_t)i));
+        }
+
+        ~thread_pool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(job_lock);
+                stopping = true;
+            }
+            job_ready.notify_all();
+
+            for(size_t i=0;i<threads.size();++i)
+                threads[i].join();
+        }
+
+        size_t size() const { return queues.size(); }
+
+        void Parallel_for(size_t count, const task_function &task)
+        {
+            if(count == 0)
+                return;
+
+            if(queues.size() == 1 || count == 1)
+            {
+                for(size_t i=0;i<count;++i)
+                    task(i, 0);
+                return;
+            }
+
+            job = &task;
+            remaining = count;
+            failure = std::exception_ptr();
+
+            for(size_t i=0;i<count;++i)
+            {
+                task_queue &q = *queues[i%queues.size()];
+                std::lock_guard<std::mutex> guard(q.lock);
+                q.tasks.push_back(i);
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(job_lock);
+                ++generation;
+            }
+            job_ready.notify_all();
+
+            Run_tasks(0);
+
+            std::exception_ptr error;
+            {
+                std::unique_lock<std::mutex> guard(job_lock);
+                job_done.wait(guard, [&]{ return remaining.load() == 0; });
+                error.swap(failure);
+            }
+
+            if(error)
+                std::rethrow_exception(error);
+        }
+};
+
+/* Log levels; a sink prints every message at or below its own level */
+enum log_level
+{
+    LOG_OFF = 0,
+    LOG_ERROR,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_TRACE
+};
+
+/* Messages above this level are compiled out of the build */
+#ifndef RBM_LOG_LEVEL
+    #define RBM_LOG_LEVEL LOG_DEBUG
+#endif
+
+/* Background flush thresholds of the log file buffer */
+#define LOG_FLUSH_BYTES (1 << 16)
+#define LOG_FLUSH_MS    200
+
+/*
+ * Buffered asynchronous logger
+ *
+ * The console and file sinks each have a runtime level. Console text is
+ * written straight through; file text is appended to an in-memory buffer
+ * that a background thread writes to the one open handle once it passes
+ * LOG_FLUSH_BYTES, or every LOG_FLUSH_MS. Flush() returns once everything
+ * written so far has reached the file.
+ */
+class logger
+{
+    private:
+        std::mutex lock;
+        std::mutex file_lock;
+        std::mutex console_lock;
+        std::condition_variable wake;
+
+        std::string buffer;
+        std::ofstream file;
+        std::thread flusher;
+        bool stopping;
+
+        log_level console_level;
+        log_level file_level;
+
+        void Flush_buffer()
+        {
+            /* file_lock first, so swapped chunks reach the file in order */
+            std::lock_guard<std::mutex> out(file_lock);
+            std::string pending;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                pending.swap(buffer);
+            }
+
+            if(!pending.empty() && file.is_open())
+            {
+                file.write(pending.data(), pending.size());
+                file.flush();
+            }
+        }
+
+        void Flush_loop()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            while(!stopping)
+            {
+                wake.wait_for(guard, std::chrono::milliseconds(LOG_FLUSH_MS),
+                              [&]{ return stopping || buffer.size() >= LOG_FLUSH_BYTES; });
+                guard.unlock();
+                Flush_buffer();
+                guard.lock();
+            }
+        }
+
+    public:
+        logger() : stopping(false), console_level(LOG_DEBUG), file_level(LOG_DEBUG) {}
+
+        ~logger()
+        {
+            Close();
+        }
+
+        bool Open(const string &name)
+        {
+            Close();
+
+            {
+                std::lock_guard<std::mutex> out(file_lock);
+                file.open(name.c_str(), ios::out | ios::trunc);
+                if(!file.is_open())
+                    return false;
+            }
+
+            stopping = false;
+            flusher = std::thread(&logger::Flush_loop, this);
+            return true;
+        }
+
+        void Close()
+        {
+            if(flusher.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    stopping = true;
+                }
+                wake.notify_all();
+                flusher.join();
+            }
+
+            Flush_buffer();
+
+            std::lock_guard<std::mutex> out(file_lock);
+            if(file.is_open())
+                file.close();
+        }
+
+        void Flush()
+        {
+            Flush_buffer();
+        }
+
+        void Set_levels(log_level console, log_level to_file)
+        {
+            console_level = console;
+            file_level = to_file;
+        }
+
+        bool Enabled(log_level level) const
+        {
+            return level <= console_level || (level <= file_level && flusher.joinable());
+        }
+
+        /* Appends raw text to the file sink regardless of level */
+        void Write_file(const string &text)
+        {
+            bool full;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                buffer += text;
+                full = buffer.size() >= LOG_FLUSH_BYTES;
+            }
+
+            if(full)
+                wake.notify_one();
+        }
+
+        void Write(log_level level, const string &text)
+        {
+            if(level <= console_level)
+            {
+                std::lock_guard<std::mutex> guard(console_lock);
+                cout<<text;
+            }
+
+            if(level <= file_level && flusher.joinable())
+                Write_file(text);
+        }
+};
+
+/* Formats the message only when a sink wants it; levels above RBM_LOG_LEVEL cost nothing */
+#define RBM_LOG(sink, level, message)                                   \
+    do {                                                                \
+        if((level) <= RBM_LOG_LEVEL && (sink).Enabled(level))           \
+        {                                                               \
+            std::ostringstream rbm_log_text;                            \
+            rbm_log_text<<message;                                      \
+            (sink).Write((level), rbm_log_text.str());                  \
+        }                                                               \
+    } while(0)
+
+/*
+ * Read-only file mapping
+ *
+ * Maps the whole file copy-on-write, so the pages can be handed out as
+ * writable matrix storage without touching the file. Where mmap is not
+ * available the file is read into an aligned buffer instead.
+ */
+class mapped_file
+{
+    private:
+        char *base;
+        size_t length;
+        bool mapped;
+
+        mapped_file(const mapped_file &);
+        mapped_file &operator=(const mapped_file &);
+
+    public:
+        mapped_file() : base(NULL), length(0), mapped(false) {}
+
+        ~mapped_file()
+        {
+            Unmap();
+        }
+
+        bool Map(const string &name)
+        {
+            Unmap();
+
+            #if RBM_POSIX
+                int fd = open(name.c_str(), O_RDONLY);
+                if(fd < 0)
+                    return false;
+
+                struct stat info;
+                if(fstat(fd, &info) != 0 || info.st_size <= 0)
+                {
+                    close(fd);
+                    return false;
+                }
+
+                void *ptr = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE, fd, 0);
+                close(fd);
+
+                if(ptr == MAP_FAILED)
+                    return false;
+
+                base = static_cast<char *>(ptr);
+                length = (size_t)info.st_size;
+                mapped = true;
+            #else
+                ifstream in(name.c_str(), ios::binary | ios::ate);
+                if(!in.is_open() || in.tellg() <= 0)
+                    return false;
+
+                length = (size_t)in.tellg();
+                base = static_cast<char *>(aligned_malloc(length));
+                in.seekg(0);
+
+                if(!in.read(base, length))
+                {
+                    Unmap();
+                    return false;
+                }
+            #endif
+
+            return true;
+        }
+
+        void Unmap()
+        {
+            if(base)
+            {
+                #if RBM_POSIX
+                    if(mapped)
+                        munmap(base, length);
+                #else
+                    aligned_free(base);
+                #endif
+            }
+
+            base = NULL;
+            length = 0;
+            mapped = false;
+        }
+
+        void swap(mapped_file &other)
+        {
+            std::swap(base, other.base);
+            std::swap(length, other.length);
+            std::swap(mapped, other.mapped);
+        }
+
+        char *data() { return base; }
+        size_t size() const { return length; }
+};
+
+/* Huge page size the workspace is rounded up to when it asks for them */
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+
+/*
+ * Training workspace arena
+ *
+ * One aligned block from which every per-run training buffer is carved
+ * with attach(). Layout is done twice at most: a pass that does not fit
+ * only measures, reserve() reallocates the block to that size, and the
+ * next pass carves. The block never shrinks, so later RBM_train calls,
+ * and models of the same shape sharing one arena, carve it again without
+ * touching the allocator. Models sharing an arena must train one at a
+ * time, and a model's carved buffers are only valid until another model
+ * trains on it.
+ */
+class workspace_arena
+{
+    private:
+        char *base;
+        size_t capacity;
+        size_t used;
+        bool huge;
+        bool mapped;
+
+        workspace_arena(const workspace_arena &);
+        workspace_arena &operator=(const workspace_arena &);
+
+        void release()
+        {
+            if(base)
+            {
+                #if RBM_POSIX
+                    if(mapped)
+                        munmap(base, capacity);
+                    else
+                        aligned_free(base);
+                #else
+                    aligned_free(base);
+                #endif
+            }
+
+            base = NULL;
+            capacity = 0;
+            mapped = false;
+        }
+
+        /* Next MATRIX_ALIGN aligned region of n bytes, or NULL while measuring */
+        char *take(size_t n)
+        {
+            char *ptr = (used + n <= capacity)? base + used : NULL;
+            used += n;
+            if(ptr && n)
+                memset(ptr, 0, n);
+            return ptr;
+        }
+
+    public:
+        workspace_arena() : base(NULL), capacity(0), used(0), huge(false), mapped(false) {}
+
+        ~workspace_arena()
+        {
+            release();
+        }
+
+        /* Huge pages apply from the next reallocation; where they are not
+           available (or not reserved) ordinary pages are used */
+        void set_huge_pages(bool enable) { huge = enable; }
+
+        /* Starts a layout pass */
+        void begin() { used = 0; }
+
+        /* Whether everything carved since begin() got memory */
+        bool fits() const { return used <= capacity; }
+
+        size_t bytes() const { return capacity; }
+        size_t used_bytes() const { return used; }
+
+        /* Replaces the block by one of at least n bytes; carved buffers are lost */
+        void reserve(size_t n)
+        {
+            release();
+
+            #if RBM_POSIX
+                if(huge)
+                {
+                    size_t length = (n + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1);
+                    void *ptr = MAP_FAILED;
+
+                    #ifdef MAP_HUGETLB
+                        ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                    #endif
+                    if(ptr == MAP_FAILED)
+                    {
+                        ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                        #ifdef MADV_HUGEPAGE
+                            if(ptr != MAP_FAILED)
+                                madvise(ptr, length, MADV_HUGEPAGE);
+                        #endif
+                    }
+                    if(ptr == MAP_FAILED)
+                        throw std::bad_alloc();
+
+                    base = static_cast<char *>(ptr);
+                    capacity = length;
+                    mapped = true;
+                    return;
+                }
+            #endif
+
+            base = static_cast<char *>(aligned_malloc(n));
+            capacity = n;
+        }
+
+        /* Zero-filled rows x cols matrix with rows padded as by resize() */
+        template <typename T>
+        void carve(dense_matrix<T> &m, size_t rows, size_t cols)
+        {
+            const size_t per_line = MATRIX_ALIGN/sizeof(T);
+            size_t stride = ((cols + per_line - 1)/per_line)*per_line;
+
+            if(stride && rows > SIZE_MAX/sizeof(T)/stride)
+                throw std::bad_alloc();
+
+            char *ptr = take(rows*stride*sizeof(T));
+            if(ptr || rows == 0)
+                m.attach(reinterpret_cast<T *>(ptr), rows, cols, stride);
+        }
+
+        void carve(bit_matrix &m, size_t rows, size_t cols)
+        {
+            const size_t per_line = MATRIX_ALIGN/sizeof(uint64_t);
+            size_t words = cols/64 + ((cols&63)? 1 : 0);
+            size_t stride = ((words + per_line - 1)/per_line)*per_line;
+
+            if(stride && rows > SIZE_MAX/sizeof(uint64_t)/stride)
+                throw std::bad_alloc();
+
+            char *ptr = take(rows*stride*sizeof(uint64_t));
+            if(ptr || rows == 0)
+                m.attach(reinterpret_cast<uint64_t *>(ptr), rows, cols, stride);
+        }
+};
+
+/*
+ * Checkpoint file layout (native byte order)
+ *
+ * A fixed-size header is followed by the weight matrix, the visible and
+ * hidden bias vectors, the per-epoch error history, with PCD the packed
+ * hidden states of the fantasy particles and, with momentum, the velocity
+ * (weights then biases, laid out the same way). Every block and each bias
+ * vector starts on a MATRIX_ALIGN boundary and the weights keep their
+ * padded row stride, so a mapped checkpoint is used as the parameters in
+ * place.
+ *
+ * Version 1 files kept the biases in row and column 0 of a
+ * (num_visible+1) x (num_hidden+1) weight matrix and a bias bit in every
+ * particle; they are still loaded, by conversion.
+ */
+#define CHECKPOINT_MAGIC   "RBMCKPT"
+#define CHECKPOINT_VERSION 2
+
+enum checkpoint_dtype
+{
+    CHECKPOINT_FLOAT64 = 1,
+    CHECKPOINT_FLOAT32 = 2
+};
+
+inline uint32_t Checkpoint_dtype(const double *) { return CHECKPOINT_FLOAT64; }
+inline uint32_t Checkpoint_dtype(const float *) { return CHECKPOINT_FLOAT32; }
+
+struct checkpoint_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint64_t header_bytes;
+
+    uint64_t num_visible;
+    uint64_t num_hidden;
+    uint64_t weight_rows;
+    uint64_t weight_cols;
+    uint64_t weight_stride;     /* elements between the starts of two rows */
+    uint64_t weight_offset;     /* bytes from the start of the file */
+
+    uint64_t epochs;
+    uint64_t curr_epoch;        /* next epoch to train */
+    uint64_t update_count;
+    uint64_t seed;
+    uint64_t draws;
+    uint64_t error_offset;      /* epochs doubles */
+
+    double learning_rate;
+    double standard_deviation;
+
+    uint64_t particle_rows;     /* 0 without PCD */
+    uint64_t particle_offset;   /* particle_rows x words_per_row uint64 words */
+    uint32_t cd_steps;          /* 0 in files written before PCD */
+    uint32_t reserved0;
+
+    uint64_t velocity_offset;   /* momentum buffer laid out like the parameters, 0 without */
+    uint64_t bias_offset;       /* visible then hidden bias vector; 0 in version 1 */
+    uint8_t reserved[16];
+};
+
+static_assert(sizeof(checkpoint_header) % MATRIX_ALIGN == 0,
+              "checkpoint header must keep the weight block aligned");
+
+static inline uint64_t Align_offset(uint64_t offset)
+{
+    return (offset + MATRIX_ALIGN - 1)/MATRIX_ALIGN*MATRIX_ALIGN;
+}
+
+/* Bytes of the two bias vectors of a checkpoint, each aligned */
+static inline uint64_t Bias_block_bytes(uint64_t num_visible, uint64_t num_hidden, size_t element)
+{
+    return Align_offset(num_visible*element) + Align_offset(num_hidden*element);
+}
+
+/*
+ * Bit-packed data file layout (native byte order)
+ *
+ * A fixed-size header is followed by rows x words_per_row uint64 words
+ * starting at data_offset. Element j of a row is bit (j%64) of word j/64,
+ * the same packing as bit_matrix, and unused high bits are zero.
+ */
+#define DATA_MAGIC      "RBMDATA"
+#define DATA_VERSION    1
+#define DATA_READ_BYTES (1 << 22)
+#define DATA_BLOCK_ROWS (1 << 16)
+
+struct data_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved0;
+
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t words_per_row;
+    uint64_t data_offset;
+
+    uint8_t reserved[16];
+};
+
+static_assert(sizeof(data_file_header) % MATRIX_ALIGN == 0,
+              "data header must keep the rows aligned");
+
+/*
+ * Source of training rows
+ *
+ * RBM_train pulls row blocks through Read_rows(), so a source never has
+ * to hold more than the block it is asked for. Read_rows() is only called
+ * from one thread at a time.
+ */
+class data_source
+{
+    public:
+        virtual ~data_source() {}
+
+        virtual uint64_t rows() const = 0;
+        virtual uint64_t cols() const = 0;
+
+        /* Unpacks rows [first, first+count) into out, resized to count x cols() */
+        virtual bool Read_rows(uint64_t first, uint64_t count, bit_matrix &out) = 0;
+};
+
+/* Bit-packed data file read in DATA_READ_BYTES chunks with positioned reads */
+class file_source : public data_source
+{
+    private:
+        #if RBM_POSIX
+            int fd;
+        #else
+            ifstream in;
+        #endif
+        data_file_header header;
+        std::vector<uint64_t> staging;
+
+        file_source(const file_source &);
+        file_source &operator=(const file_source &);
+
+        bool Read_at(uint64_t offset, void *dst, size_t bytes)
+        {
+            char *out = static_cast<char *>(dst);
+
+            #if RBM_POSIX
+                while(bytes)
+                {
+                    ssize_t got = pread(fd, out, bytes, (off_t)offset);
+                    if(got < 0 && errno == EINTR)
+                        continue;
+                    if(got <= 0)
+                        return false;
+
+                    out += got;
+                    offset += got;
+                    bytes -= got;
+                }
+                return true;
+            #else
+                in.clear();
+                in.seekg((streamoff)offset);
+                return (bool)in.read(out, bytes);
+            #endif
+        }
+
+    public:
+        file_source()
+        {
+            #if RBM_POSIX
+                fd = -1;
+            #endif
+            memset(&header, 0, sizeof(header));
+        }
+
+        ~file_source()
+        {
+            Close();
+        }
+
+        bool Open(const string &name)
+        {
+            Close();
+
+            #if RBM_POSIX
+                fd = open(name.c_str(), O_RDONLY);
+                if(fd < 0)
+                    return false;
+
+                struct stat info;
+                uint64_t file_bytes = (fstat(fd, &info) == 0)? (uint64_t)info.st_size : 0;
+            #else
+                in.open(name.c_str(), ios::binary | ios::ate);
+                if(!in.is_open())
+                    return false;
+
+                uint64_t file_bytes = (uint64_t)in.tellg();
+            #endif
+
+            if(file_bytes < sizeof(header) || !Read_at(0, &header, sizeof(header))
+               || memcmp(header.magic, DATA_MAGIC, sizeof(DATA_MAGIC)) != 0
+               || header.version != DATA_VERSION
+               || header.words_per_row != (header.cols+63)/64
+               || header.data_offset < sizeof(header)
+               || header.data_offset > file_bytes
+               || header.rows > (file_bytes - header.data_offset)/8/(header.words_per_row? header.words_per_row : 1))
+            {
+                Close();
+                return false;
+            }
+
+            return true;
+        }
+
+        void Close()
+        {
+            #if RBM_POSIX
+                if(fd >= 0)
+                    close(fd);
+                fd = -1;
+            #else
+                if(in.is_open())
+                    in.close();
+            #endif
+            memset(&header, 0, sizeof(header));
+        }
+
+        uint64_t rows() const { return header.rows; }
+        uint64_t cols() const { return header.cols; }
+
+        bool Read_rows(uint64_t first, uint64_t count, bit_matrix &out)
+        {
+            if(first > header.rows || count > header.rows - first)
+                return false;
+
+            const size_t wpr = header.words_per_row;
+            const uint64_t tail = (header.cols & 63)? ((uint64_t)1 << (header.cols & 63)) - 1 : ~(uint64_t)0;
+
+            out.resize(count, header.cols);
+            if(wpr == 0)
+                return true;
+
+            uint64_t chunk_rows = DATA_READ_BYTES/(wpr*8);
+            if(chunk_rows == 0)
+                chunk_rows = 1;
+            staging.resize(chunk_rows*wpr);
+
+            for(uint64_t done=0;done<count;done+=chunk_rows)
+            {
+                uint64_t n = (count - done < chunk_rows)? count - done : chunk_rows;
+
+                if(!Read_at(header.data_offset + (first + done)*wpr*8, &staging[0], n*wpr*8))
+                    return false;
+
+                for(uint64_t i=0;i<n;++i)
+                {
+                    uint64_t *dst = out.row(done + i);
+                    memcpy(dst, &staging[i*wpr], wpr*8);
+                    dst[wpr-1] &= tail;
+                }
+            }
+
+            return true;
+        }
+};
+
+/* Streams rows into a bit-packed data file; the row count is written by Close() */
+class data_file_writer
+{
+    private:
+        ofstream out;
+        data_file_header header;
+        std::vector<uint64_t> packed;
+
+    public:
+        data_file_writer()
+        {
+            memset(&header, 0, sizeof(header));
+        }
+
+        ~data_file_writer()
+        {
+            Close();
+        }
+
+        bool Open(const string &name, uint64_t cols)
+        {
+            Close();
+
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, DATA_MAGIC, sizeof(DATA_MAGIC));
+            header.version = DATA_VERSION;
+            header.cols = cols;
+            header.words_per_row = (cols+63)/64;
+            header.data_offset = Align_offset(sizeof(header));
+            packed.resize(header.words_per_row);
+
+            out.open(name.c_str(), ios::binary | ios::trunc);
+            if(!out.is_open())
+                return false;
+
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            return (bool)out;
+        }
+
+        bool Append(const vect_bool &row)
+        {
+            if(!out.is_open() || row.size() != header.cols)
+                return false;
+
+            std::fill(packed.begin(), packed.end(), 0);
+            for(size_t j=0;j<row.size();++j)
+                packed[j>>6] |= (uint64_t)row[j] << (j&63);
+
+            if(!packed.empty())
+                out.write(reinterpret_cast<const char *>(&packed[0]), packed.size()*8);
+            ++header.rows;
+            return (bool)out;
+        }
+
+        bool Close()
+        {
+            if(!out.is_open())
+                return true;
+
+            out.seekp(0);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.close();
+            return !out.fail();
+        }
+};
+
+/* Rows of a data_view streamed like a file, e.g. under a DBN layer_source;
+   the view is checked by whoever trains on it */
+class view_source : public data_source
+{
+    private:
+        data_view view;
+
+    public:
+        view_source() { memset(&view, 0, sizeof(view)); }
+        explicit view_source(const data_view &rows) : view(rows) {}
+
+        uint64_t rows() const { return view.rows; }
+        uint64_t cols() const { return view.cols; }
+
+        bool Read_rows(uint64_t first, uint64_t count, bit_matrix &out)
+        {
+            if(first > view.rows || count > view.rows - first)
+                return false;
+
+            out.resize(count, view.cols);
+            for(uint64_t i=0;i<count;++i)
+            {
+                if(view.layout == VIEW_BITS)
+                    memcpy(out.row(i), static_cast<const uint64_t *>(view.ptr) + (first+i)*view.stride,
+                           out.words_per_row()*sizeof(uint64_t));
+                else
+                    Pack_bytes(static_cast<const uint8_t *>(view.ptr) + (first+i)*view.stride,
+                               view.cols, out.row(i));
+            }
+
+            return true;
+        }
+};
+
+/* Purposes of the counter-based generator streams (low byte of Philox counter word 1) */
+#define RNG_STREAM_SEQUENTIAL 0u
+#define RNG_STREAM_HIDDEN     1u
+#define RNG_STREAM_PARTICLE   2u
+#define RNG_STREAM_INFERENCE  3u
+
+/*
+ * Structure for Random Number Generation
+ *
+ * Philox4x32-10 keyed by the seed. generate_random() walks one sequential
+ * stream (initialisation, shuffling); Fill_uniform() addresses a stream
+ * directly by (purpose, Gibbs step, weight update, row), so every row of
+ * every Gibbs step gets the same numbers no matter which thread samples it.
+ */
+struct random
+{
+    double standard_deviation;
+
+    uint64_t seed;
+    uint64_t draws;
+
+    /* Membership Functions */
+    void set_random_seed(uint64_t value = (uint64_t)time(0));
+    double generate_random(double lower_limit, double higher_limit);
+    void Fill_uniform(uint32_t purpose, uint32_t step, uint64_t update, uint64_t row,
+                      double *out, size_t n) const;
+    void Fill_uniform(uint32_t purpose, uint32_t step, uint64_t update, uint64_t row,
+                      float *out, size_t n) const;
+
+};
+
+/* Rows per tile of the fused Gibbs chain; a multiple of GEMM_MR */
+#define GIBBS_TILE_ROWS 64
+
+/* The gradient of a batch is summed in at most GRADIENT_SLICES row slices of
+   at least GRADIENT_SLICE_ROWS rows each, then reduced in a fixed tree */
+#define GRADIENT_SLICES 8
+#define GRADIENT_SLICE_ROWS 32
+
+/* Slices of a gradient over rows; depends on the rows only, so the summation
+   order is the same for any thread count */
+static inline size_t Gradient_slices(uint64_t rows)
+{
+    uint64_t slices = (rows + GRADIENT_SLICE_ROWS - 1)/GRADIENT_SLICE_ROWS;
+    if(slices > GRADIENT_SLICES)
+        slices = GRADIENT_SLICES;
+
+    return (slices == 0)? 1 : (size_t)slices;
+}
+
+/* Training phases timed by RBM_train */
+enum train_phase
+{
+    PHASE_POSITIVE = 0,     /* hidden probabilities and samples of the data */
+    PHASE_GIBBS,            /* negative chain (CD) or particle updates (PCD) */
+    PHASE_ASSOCIATIONS,     /* positive and negative associations */
+    PHASE_UPDATE,           /* reduction of the partial sums and weight update */
+    PHASE_ERROR,            /* reconstruction error */
+    PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] =
+{
+    "positive", "gibbs", "associations", "update", "error"
+};
+
+typedef std::chrono::steady_clock train_clock;
+
+static inline double Seconds_since(train_clock::time_point start)
+{
+    return std::chrono::duration<double>(train_clock::now() - start).count();
+}
+
+/*
+ * Training statistics of one epoch, or summed over a run
+ *
+ * Times are monotonic wall-clock seconds. Each parallel region's wall time
+ * is split between the phases it ran in proportion to the workers' busy
+ * time in them, so phase_seconds plus other_seconds adds up to seconds.
+ * flops counts the dense Gemm products (2*m*n*k) even where the masked
+ * kernels skip zeros.
+ */
+struct train_stats
+{
+    uint32_t epoch;                         /* 1-based; epochs run for the totals */
+    double seconds;
+    double phase_seconds[PHASE_COUNT];
+    double other_seconds;                   /* batching, shuffling and block reads */
+    uint64_t rows;
+    uint64_t updates;
+    double flops;
+    uint64_t bytes_allocated;               /* training buffers, peak for the totals */
+    double error;
+    double valid_error;                     /* monitor: mean squared reconstruction error per row */
+    double free_energy_gap;                 /* monitor: mean F(held-out) - mean F(training sample) */
+};
+
+/* Training rows sampled by the monitor when no count is given */
+#define MONITOR_SAMPLE_ROWS 1024
+
+/* Learning rate schedules over the epochs of a run */
+enum lr_schedule
+{
+    SCHEDULE_CONSTANT,
+    SCHEDULE_STEP,      /* rate * factor^(epoch/every) */
+    SCHEDULE_COSINE     /* cosine decay from rate to rate * factor */
+};
+
+/* One value per parameter: the num_visible x num_hidden weights and the two
+   bias vectors. Holds gradients and momentum velocities */
+template <typename T>
+struct rbm_gradient
+{
+    dense_matrix<T> weights;
+    dense_matrix<T> visible;    /* 1 x num_visible */
+    dense_matrix<T> hidden;     /* 1 x num_hidden */
+
+    void resize(size_t num_visible, size_t num_hidden)
+    {
+        weights.resize(num_visible, num_hidden);
+        visible.resize(1, num_visible);
+        hidden.resize(1, num_hidden);
+    }
+
+    void fill(T value)
+    {
+        weights.fill(value);
+        visible.fill(value);
+        hidden.fill(value);
+    }
+
+    size_t rows() const { return weights.rows(); }
+    size_t bytes() const { return weights.bytes() + visible.bytes() + hidden.bytes(); }
+};
+
+/* Restricted Boltzmann Machine Class, templated on the scalar type of the
+   weights and of every activation buffer (double or float) */
+template <typename T>
+class basic_rbm : public random
+{
+   private:
+        bool net_stat;
+        bool ready_to_train;
+        uint8_t bias_init_type;
+
+        double learning_rate;
+        double curr_rate;
+
+        /* Optimizer: heavy-ball or Nesterov momentum, L2 decay of the weights */
+        double momentum;
+        bool nesterov;
+        double weight_decay;
+        lr_schedule schedule;
+        double schedule_factor;
+        uint32_t schedule_every;
+
+        vect_double error;
+
+        mutable logger log_stream;
+        string log_name;
+
+        uint64_t num_hidden;
+        uint64_t num_visible;
+        uint64_t train_data_rows;
+        uint64_t train_data_cols;
+
+        uint64_t batch_size;
+        uint64_t batch_rows;
+        uint64_t curr_batch_rows;
+
+        uint32_t curr_epoch;
+        uint32_t epochs;
+        uint32_t start_epoch;
+
+        double data_density;
+
+        bit_matrix data;
+        bit_matrix batch_data;
+        bit_matrix pos_hidden_states;
+
+        const bit_matrix *curr_batch;
+        std::vector<uint64_t> row_order;
+
+        /* Caller bytes of a VIEW_BOOL or VIEW_UINT8 view; batches are packed
+           from them into batch_data, and data stays empty */
+        bool byte_input;
+        dense_bool byte_data;
+
+        /* CSR data replaces data and batch_data when sparse_input is set */
+        bool sparse_input;
+        csr_matrix sparse_data;
+        csr_matrix sparse_batch;
+        const csr_matrix *curr_sparse;
+
+        data_source *source;
+        bit_matrix next_block;
+        uint64_t block_size;
+        std::vector<uint64_t> block_order;
+
+        dense_matrix<T> weights;        /* num_visible x num_hidden */
+        dense_matrix<T> visible_bias;   /* 1 x num_visible */
+        dense_matrix<T> hidden_bias;    /* 1 x num_hidden */
+
+        rbm_gradient<T> gradient;       /* positive minus negative associations */
+        rbm_gradient<T> velocity;       /* momentum buffer, empty without momentum */
+
+        dense_matrix<T> pos_hidden_probs;
+        dense_matrix<T> neg_visible_probs;
+        dense_matrix<T> neg_hidden_probs;
+
+        dense_matrix<T> uniforms;
+
+        /* Per-run buffers are carved from *workspace, own_workspace unless
+           the caller shares an arena between models */
+        workspace_arena own_workspace;
+        workspace_arena *workspace;
+
+        unsigned num_threads;
+        std::unique_ptr<thread_pool> pool;
+        uint64_t update_count;
+        uint64_t batch_first;
+        uint32_t cd_steps;
+
+        uint64_t num_particles;
+        bool particles_ready;
+        bit_matrix particle_states;
+        dense_matrix<T> particle_visible_probs;
+        dense_matrix<T> particle_hidden_probs;
+
+        vect_double partial_error;
+        std::vector<rbm_gradient<T>> partial_gradients;
+
+        mapped_file checkpoint_map;
+        string checkpoint_name;
+        uint32_t checkpoint_every;
+
+        /* Held-out rows, bit-packed or CSR, and the
+           monitor evaluating them every monitor_every epochs */
+        bit_matrix valid_data;
+        csr_matrix valid_sparse;
+        uint32_t monitor_every;
+        uint32_t monitor_patience;
+        double monitor_min_delta;
+        uint64_t monitor_sample_rows;
+        double monitor_best;
+        uint32_t monitor_best_epoch;
+        uint32_t monitor_wait;
+        std::vector<dense_matrix<T>> monitor_input;     /* per worker tile of unpacked rows */
+        std::vector<dense_matrix<T>> monitor_output;    /* per worker tile of reconstructions */
+        vect_double monitor_energy;
+
+        train_stats epoch_stats;
+        train_stats total_stats;
+        dense_matrix<double> phase_busy;    /* worker x phase busy seconds of a region */
+        std::ofstream stats_file;
+
+        void Attribute_phases(double wall);
+        void Write_stats(const train_stats &stats, const char *type);
+        uint64_t Training_bytes() const;
+        double Batch_flops() const;
+
+        bool Write_checkpoint(const string &name, uint32_t next_epoch);
+
+        template <typename M>
+        void Evaluate_rows(const M &rows, uint64_t count, double &error, double &energy);
+        bool Monitor();
+
+        template <typename V>
+        bool Hidden_inputs(const V *visible, size_t ldv, uint64_t rows,
+                           T *hidden, size_t ldh, const char *caller) const;
+
+    public:
+
+        /* Constructor Functions */
+        /* The log file is created at once, with the sinks already at the given
+           levels; an empty name logs to the console only */
+        explicit basic_rbm(const string &log_file = "RBM_Log_File.txt",
+                           log_level console = LOG_DEBUG, log_level file = LOG_DEBUG);
+        bool Get_netstat();
+        uint64_t Get_num_visible() const;
+        uint64_t Get_num_hidden() const;
+        bool Get_ready_to_train();
+        void Set_netstat(bool data);
+        void set_std(double value=0.01);
+        void Set_ready_to_train(bool data);
+        void Set_batch_size(uint64_t size);
+        void Set_threads(unsigned count = 0);
+        void Set_workspace(workspace_arena *arena);
+        void Set_huge_pages(bool enable);
+
+        /* Data Assembling Functions */
+        bool Get_data(matrix_bool &arr,uint64_t nrows);
+        bool Get_data(const csr_matrix &arr, uint64_t nrows);
+        bool Get_data(data_source &rows);
+        bool Get_data(const data_view &view);
+        void Set_block_size(uint64_t size);
+        bool Set_validation(matrix_bool &arr, uint64_t nrows);
+        bool Set_validation(const csr_matrix &arr, uint64_t nrows);
+        void Set_monitor(uint32_t every, uint32_t patience = 0, double min_delta = 0.0,
+                         uint64_t sample_rows = 0);
+
+        /* Data Display Functions */
+        void Display_data(uint8_t precision = 7, char *notation ="scientific");
+        void Display_error(uint8_t precision = 7, char *notation ="scientific");
+        void Display_weights(uint8_t precision = 7, char *notation ="scientific");
+        void Display_Neg_visible_probs(uint8_t precision=7,
+                                           char *notation ="scientific");
+        void Display_Neg_hidden_probs(uint8_t precision=7,
+                                           char *notation ="scientific");
+        void Display_Pos_hidden_probs(uint8_t precision=7,
+                                           char *notation ="scientific");
+        void Display_gradient(uint8_t precision=7,
+                                           char *notation ="scientific");
+        void Display_Pos_hidden_States(uint8_t precision=7,
+                                           char *notation ="scientific");
+
+        /* Handle Files */
+        bool Create_file();
+        bool Check_file(const string &name);
+        bool Set_log_file(const string &name);
+        void Set_log_level(log_level console, log_level file);
+        bool Save_checkpoint(const string &name);
+        bool Load_checkpoint(const string &name);
+        void Set_checkpoint(const string &name, uint32_t every = 1);
+        bool Set_stats_file(const string &name);
+
+        /* Training Statistics */
+        const train_stats &Get_epoch_stats() const;
+        const train_stats &Get_total_stats() const;
+
+        /* RBM Initialization Functions */
+        bool Init_bias(char *type = "zeros");
+        bool Init_weights(char *type = "gaussian");
+        bool Init_RBM(uint64_t no_hidden, uint64_t no_visible, double alpha = 0.1);
+
+        /* RBM Parameters Configuration Functions */
+        void Config_probs();
+        void Config_error();
+        void Config_associations();
+        void Config_hiddden_states();
+        void Config_particles();
+        void Config_batch();
+        void Config_threads();
+        void Config_workspace();
+
+        /* RBM core Functions */
+        double Update_error(uint64_t first, uint64_t count);
+        void Compute_error();
+        void Measure_density();
+        void Shuffle_rows();
+        void Shuffle_blocks(uint64_t blocks);
+        bool Read_block(uint64_t index, bit_matrix &out);
+        bool Train_epoch();
+        void Train_rows();
+        void Load_batch(uint64_t first);
+        void Train_batch();
+        void Update_weights();
+        void Reduce_gradients(size_t slices);
+        void Gibbs_sampling(uint64_t first, uint64_t count, size_t worker);
+        void Mat_mul(bool course); /*{ 1= row-wise; 0 = column-wise } */
+        double Logistic(double value);
+        void Set_cd_steps(uint32_t steps);
+        void Set_optimizer(double mu = 0.0, bool use_nesterov = FALSE, double decay = 0.0);
+        void Set_schedule(lr_schedule type, double factor = 0.1, uint32_t every = 0);
+        double Scheduled_rate(uint32_t epoch) const;
+        void Set_pcd(uint64_t particles);
+        void Compute_neg_associations(const dense_matrix<T> &visible, const dense_matrix<T> &hidden,
+                                      uint64_t first, uint64_t count, double scale,
+                                      rbm_gradient<T> &grad);
+        void Compute_pos_associations(uint64_t first, uint64_t count, rbm_gradient<T> &grad);
+        void Compute_hidden_states(const dense_matrix<T> &probs, bit_matrix &states,
+                                   uint64_t first, uint64_t count, size_t worker,
+                                   uint32_t stream, uint32_t step, uint64_t stream_row);
+		void Compute_pos_visible_states();
+        void Compute_pos_hidden_probs(uint64_t first, uint64_t count, size_t worker);
+        void Compute_neg_hidden_probs(const dense_matrix<T> &visible, dense_matrix<T> &hidden,
+                                      uint64_t first, uint64_t count);
+        void Compute_neg_visible_probs(const bit_matrix &states, dense_matrix<T> &visible,
+                                       uint64_t first, uint64_t count);
+        void Advance_particles(uint64_t first, uint64_t count, size_t worker);
+        void Init_particles();
+        bool RBM_train(uint32_t epochs = 3000, bool method=FALSE);
+
+        /* Inference Functions
+         *
+         * const and reentrant: rows x num_visible inputs (ldv elements
+         * between rows) are read from the caller and results
+         * written to caller buffers, so one trained model serves any number
+         * of threads. Only training or loading may not run concurrently.
+         */
+        template <typename V>
+        bool Hidden_probs(const V *visible, size_t ldv, uint64_t rows,
+                          T *hidden, size_t ldh) const;
+        template <typename V>
+        bool Hidden_samples(const V *visible, size_t ldv, uint64_t rows, uint64_t request,
+                            uint8_t *states, size_t lds) const;
+        template <typename V>
+        bool Reconstruct(const V *visible, size_t ldv, uint64_t rows,
+                         T *reconstruction, size_t ldr) const;
+        template <typename V>
+        bool Free_energy(const V *visible, size_t ldv, uint64_t rows, double *energy) const;
+};
+
+typedef basic_rbm<double> RBM;
+typedef basic_rbm<float> RBM_float;
+
+void random::set_random_seed(uint64_t value)
+{
+    seed = value;
+    draws = 0;
+}
+
+double random::generate_random(double lower_limit, double higher_limit)
+{
+    const uint32_t key[2] = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+    const uint32_t ctr[4] = { (uint32_t)draws, RNG_STREAM_SEQUENTIAL,
+                              (uint32_t)(draws >> 32), 0 };
+    uint32_t r[4];
+
+    Philox_block(key, ctr, r);
+    ++draws;
+
+    return(lower_limit + Bits_to_uniform(r[0], r[1])*(higher_limit-lower_limit));
+}
+
+void random::Fill_uniform(uint32_t purpose, uint32_t step, uint64_t update, uint64_t row,
+                          double *out, size_t n) const
+{
+    /* The high halves of row and update select a different key, so streams
+       below 2^32 rows and updates keep the plain seed */
+    const uint32_t key[2] = { (uint32_t)seed ^ (uint32_t)(row >> 32),
+                              (uint32_t)(seed >> 32) ^ (uint32_t)(update >> 32) };
+    const uint32_t ctr[4] = { 0, purpose | (step << 8), (uint32_t)row, (uint32_t)update };
+
+    Simd().uniform(key, ctr, out, n);
+}
+
+void random::Fill_uniform(uint32_t purpose, uint32_t step, uint64_t update, uint64_t row,
+                          float *out, size_t n) const
+{
+    const uint32_t key[2] = { (uint32_t)seed ^ (uint32_t)(row >> 32),
+                              (uint32_t)(seed >> 32) ^ (uint32_t)(update >> 32) };
+    const uint32_t ctr[4] = { 0, purpose | (step << 8), (uint32_t)row, (uint32_t)update };
+
+    Simd<float>().uniform(key, ctr, out, n);
+}
+
+template <typename T>
+void basic_rbm<T>::set_std(double value)
+{
+    standard_deviation = value;
+}
+
+template <typename T>
+basic_rbm<T>::basic_rbm(const string &log_file, log_level console, log_level file)
+{
+    log_stream.Set_levels(console, file);
+
+    num_hidden = 0;
+    num_visible = 0;
+    learning_rate = 0.1;
+    curr_rate = learning_rate;
+    momentum = 0.0;
+    nesterov = FALSE;
+    weight_decay = 0.0;
+    schedule = SCHEDULE_CONSTANT;
+    schedule_factor = 0.1;
+    schedule_every = 0;
+    curr_epoch=0;
+    epochs=0;
+    start_epoch=0;
+    data_density=0.0;
+
+    batch_size=0;
+    batch_rows=0;
+    curr_batch_rows=0;
+    curr_batch=&data;
+    byte_input=FALSE;
+    sparse_input=FALSE;
+    curr_sparse=&sparse_data;
+
+    source=NULL;
+    block_size=0;
+
+    workspace=&own_workspace;
+
+    num_threads=1;
+    update_count=0;
+    batch_first=0;
+    cd_steps=1;
+    num_particles=0;
+    particles_ready=FALSE;
+
+    memset(&epoch_stats, 0, sizeof(epoch_stats));
+    memset(&total_stats, 0, sizeof(total_stats));
+    checkpoint_every=0;
+
+    monitor_every=0;
+    monitor_patience=0;
+    monitor_min_delta=0.0;
+    monitor_sample_rows=0;
+    monitor_best=0.0;
+    monitor_best_epoch=0;
+    monitor_wait=0;
+
+    error.reserve(1);
+
+    bias_init_type=0;
+
+    set_random_seed();
+    set_std();
+
+    log_name = log_file;
+    if(!log_name.empty())
+        Create_file();
+
+    RBM_LOG(log_stream, LOG_INFO, "\n Initializing Restricted Boltzmann Machine ... Success\n");
+}
+
+template <typename T>
+void basic_rbm<T>::Config_error()
+{
+    error.resize(epochs);
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Error dimensions: 1 * "<<error.size()
+                                   <<"\n");
+}
+
+template <typename T>
+bool basic_rbm<T>::Create_file()
+{
+    if(Check_file(log_name))
+    {
+        remove(log_name.c_str());
+        RBM_LOG(log_stream, LOG_DEBUG, "\n Previous log file found and replaced");
+    }
+
+    if(!log_stream.Open(log_name))
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: File not created \n");
+        return FALSE;
+    }
+
+    time_t t = time(0);   // get time now
+    struct tm local;
+    struct tm * now = &local;
+    #if RBM_POSIX
+        localtime_r(&t, now);   /* models may be created on several threads */
+    #else
+        localtime_s(now, &t);
+    #endif
+
+    std::ostringstream header;
+    header<<"\n Restricted Boltzmann Machine \n"
+          <<"\n Log Created on : "
+          <<  now->tm_mday<<'-'
+          << (now->tm_mon + 1) << '-'
+          << (now->tm_year + 1900)<<" "
+          << now->tm_hour<<':'
+          << now->tm_min<<':'
+          << now->tm_sec<<" Local Time\n";
+    log_stream.Write_file(header.str());
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n File creation : Success \n");
+
+    return TRUE;
+}
+
+template <typename T>
+bool basic_rbm<T>::Set_log_file(const string &name)
+{
+    /* An empty name closes the log file */
+    log_name = name;
+    if(log_name.empty())
+    {
+        log_stream.Close();
+        return TRUE;
+    }
+    return Create_file();
+}
+
+template <typename T>
+void basic_rbm<T>::Set_log_level(log_level console, log_level file)
+{
+    /* LOG_OFF silences a sink; levels above RBM_LOG_LEVEL are compiled out */
+    log_stream.Set_levels(console, file);
+}
+
+template <typename T>
+bool basic_rbm<T>::Save_checkpoint(const string &name)
+{
+    return Write_checkpoint(name, curr_epoch);
+}
+
+template <typename T>
+void basic_rbm<T>::Set_checkpoint(const string &name, uint32_t every)
+{
+    /* RBM_train saves to name after every every-th epoch; 0 disables */
+    checkpoint_name = name;
+    checkpoint_every = every;
+}
+
+template <typename T>
+bool basic_rbm<T>::Set_stats_file(const string &name)
+{
+    /* One JSON object per epoch and one for the run; an empty name stops */
+    if(stats_file.is_open())
+        stats_file.close();
+
+    if(name.empty())
+        return TRUE;
+
+    stats_file.clear();
+    stats_file.open(name.c_str(), ios::out | ios::app);
+    if(!stats_file)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Stats file not created : "<<name<<"\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+template <typename T>
+const train_stats &basic_rbm<T>::Get_epoch_stats() const
+{
+    return epoch_stats;
+}
+
+template <typename T>
+const train_stats &basic_rbm<T>::Get_total_stats() const
+{
+    return total_stats;
+}
+
+template <typename T>
+void basic_rbm<T>::Write_stats(const train_stats &stats, const char *type)
+{
+    if(!stats_file.is_open())
+        return;
+
+    std::ostringstream line;
+    line<<setprecision(9)
+        <<"{\"type\":\""<<type<<"\",\"epoch\":"<<stats.epoch
+        <<",\"seconds\":"<<stats.seconds;
+    for(size_t p=0;p<PHASE_COUNT;++p)
+        line<<",\""<<phase_names[p]<<"_seconds\":"<<stats.phase_seconds[p];
+    line<<",\"other_seconds\":"<<stats.other_seconds
+        <<",\"rows\":"<<stats.rows
+        <<",\"updates\":"<<stats.updates
+        <<",\"rows_per_s\":"<<((stats.seconds > 0.0)? stats.rows/stats.seconds : 0.0)
+        <<",\"flops\":"<<stats.flops
+        <<",\"gflops\":"<<((stats.seconds > 0.0)? stats.flops/stats.seconds*1e-9 : 0.0)
+        <<",\"bytes_allocated\":"<<stats.bytes_allocated
+        <<",\"error\":"<<stats.error
+        <<",\"valid_error\":"<<stats.valid_error
+        <<",\"free_energy_gap\":"<<stats.free_energy_gap<<"}\n";
+
+    stats_file<<line.str();
+    stats_file.flush();
+}
+
+template <typename T>
+uint64_t basic_rbm<T>::Training_bytes() const
+{
+    /* Owned training buffers and the workspace arena; mapped checkpoint
+       weights are not counted */
+    uint64_t bytes = data.bytes() + batch_data.bytes() + next_block.bytes()
+                   + sparse_data.bytes() + sparse_batch.bytes()
+                   + pos_hidden_states.bytes() + particle_states.bytes()
+                   + weights.bytes() + visible_bias.bytes() + hidden_bias.bytes()
+                   + gradient.bytes() + velocity.bytes()
+                   + pos_hidden_probs.bytes() + neg_visible_probs.bytes() + neg_hidden_probs.bytes()
+                   + particle_visible_probs.bytes() + particle_hidden_probs.bytes()
+                   + uniforms.bytes() + phase_busy.bytes()
+                   + valid_data.bytes() + valid_sparse.bytes()
+                   + workspace->bytes();
+
+    for(size_t i=0;i<partial_gradients.size();++i)
+        bytes += partial_gradients[i].bytes();
+
+    for(size_t i=0;i<monitor_input.size();++i)
+        bytes += monitor_input[i].bytes() + monitor_output[i].bytes();
+
+    return bytes;
+}
+
+template <typename T>
+bool basic_rbm<T>::Write_checkpoint(const string &name, uint32_t next_epoch)
+{
+    if(!Get_netstat() || weights.rows() == 0)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: RBM haven't been initialized yet!! \n");
+        return FALSE;
+    }
+
+    checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.dtype = Checkpoint_dtype(weights.data());
+    header.header_bytes = sizeof(header);
+
+    header.num_visible = num_visible;
+    header.num_hidden = num_hidden;
+    header.weight_rows = weights.rows();
+    header.weight_cols = weights.cols();
+    header.weight_stride = weights.row_stride();
+    header.weight_offset = Align_offset(sizeof(header));
+
+    uint64_t weight_bytes = header.weight_rows*header.weight_stride*sizeof(T);
+    uint64_t bias_bytes = Bias_block_bytes(num_visible, num_hidden, sizeof(T));
+
+    header.bias_offset = Align_offset(header.weight_offset + weight_bytes);
+
+    header.epochs = error.size();
+    header.curr_epoch = next_epoch;
+    header.update_count = update_count;
+    header.seed = seed;
+    header.draws = draws;
+    header.error_offset = header.bias_offset + bias_bytes;
+
+    header.learning_rate = learning_rate;
+    header.standard_deviation = standard_deviation;
+
+    uint64_t error_bytes = error.size()*sizeof(double);
+    uint64_t particle_bytes = 0;
+    uint64_t end = header.error_offset + error_bytes;
+
+    header.cd_steps = cd_steps;
+    if(num_particles && particles_ready)
+    {
+        header.particle_rows = particle_states.rows();
+        header.particle_offset = Align_offset(end);
+        particle_bytes = header.particle_rows*particle_states.words_per_row()*sizeof(uint64_t);
+        end = header.particle_offset + particle_bytes;
+    }
+
+    /* The momentum buffer follows, in the parameters' layout */
+    if(velocity.rows())
+        header.velocity_offset = Align_offset(end);
+
+    /* Written beside the target and renamed over it, so a pre-empted
+       job never leaves a torn checkpoint behind */
+    string temp = name + ".tmp";
+    ofstream out(temp.c_str(), ios::binary | ios::trunc);
+    static const char padding[MATRIX_ALIGN] = { 0 };
+
+    /* Weights with their row stride, then each bias vector padded to alignment */
+    auto write_params = [&](const dense_matrix<T> &w, const dense_matrix<T> &vb, const dense_matrix<T> &hb)
+    {
+        for(uint64_t i=0;i<w.rows();++i)
+            out.write(reinterpret_cast<const char *>(w.row(i)), header.weight_stride*sizeof(T));
+        out.write(padding, Align_offset(weight_bytes) - weight_bytes);
+        out.write(reinterpret_cast<const char *>(vb.data()), num_visible*sizeof(T));
+        out.write(padding, Align_offset(num_visible*sizeof(T)) - num_visible*sizeof(T));
+        out.write(reinterpret_cast<const char *>(hb.data()), num_hidden*sizeof(T));
+        out.write(padding, Align_offset(num_hidden*sizeof(T)) - num_hidden*sizeof(T));
+    };
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(padding, header.weight_offset - sizeof(header));
+    write_params(weights, visible_bias, hidden_bias);
+    if(!error.empty())
+        out.write(reinterpret_cast<const char *>(&error[0]), error_bytes);
+    end = header.error_offset + error_bytes;
+    if(particle_bytes)
+    {
+        out.write(padding, header.particle_offset - end);
+        for(uint64_t p=0;p<header.particle_rows;++p)
+            out.write(reinterpret_cast<const char *>(particle_states.row(p)),
+                      particle_states.words_per_row()*sizeof(uint64_t));
+        end = header.particle_offset + particle_bytes;
+    }
+    if(header.velocity_offset)
+    {
+        out.write(padding, header.velocity_offset - end);
+        write_params(velocity.weights, velocity.visible, velocity.hidden);
+    }
+    out.close();
+
+    if(!out)
+    {
+        remove(temp.c_str());
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Checkpoint not written : "<<name<<"\n");
+        return FALSE;
+    }
+
+    #if defined(_WIN32)
+        remove(name.c_str());
+    #endif
+
+    if(rename(temp.c_str(), name.c_str()) != 0)
+    {
+        remove(temp.c_str());
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Checkpoint not written : "<<name<<"\n");
+        return FALSE;
+    }
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Checkpoint saved : "<<name
+                                   <<" (next epoch "<<next_epoch+1<<")\n");
+    return TRUE;
+}
+
+/* Element index of a checkpoint block of either precision */
+static inline double Checkpoint_value(const char *block, uint32_t dtype, uint64_t index)
+{
+    return (dtype == CHECKPOINT_FLOAT32)? (double)reinterpret_cast<const float *>(block)[index]
+                                        : reinterpret_cast<const double *>(block)[index];
+}
+
+/* Copies weights and biases out of a checkpoint block into w, vb and hb,
+   already sized num_visible x num_hidden, converting the precision and,
+   for version 1, splitting the biases out of row and column 0 */
+template <typename T>
+static void Convert_checkpoint_params(const char *block, const checkpoint_header &header,
+                                      dense_matrix<T> &w, dense_matrix<T> &vb, dense_matrix<T> &hb)
+{
+    const uint64_t stride = header.weight_stride;
+    const size_t element = (header.dtype == CHECKPOINT_FLOAT32)? sizeof(float) : sizeof(double);
+    T *visible = vb.data();
+    T *hidden = hb.data();
+
+    if(header.version == 1)
+    {
+        for(uint64_t i=0;i<w.rows();++i)
+        {
+            T *row = w.row(i);
+            for(uint64_t j=0;j<w.cols();++j)
+                row[j] = (T)Checkpoint_value(block, header.dtype, (i+1)*stride + j+1);
+            visible[i] = (T)Checkpoint_value(block, header.dtype, (i+1)*stride);
+        }
+        for(uint64_t j=0;j<w.cols();++j)
+            hidden[j] = (T)Checkpoint_value(block, header.dtype, j+1);
+        return;
+    }
+
+    const char *biases = block + Align_offset(w.rows()*stride*element);
+    const char *hidden_biases = biases + Align_offset(w.rows()*element);
+
+    for(uint64_t i=0;i<w.rows();++i)
+    {
+        T *row = w.row(i);
+        for(uint64_t j=0;j<w.cols();++j)
+            row[j] = (T)Checkpoint_value(block, header.dtype, i*stride + j);
+        visible[i] = (T)Checkpoint_value(biases, header.dtype, i);
+    }
+    for(uint64_t j=0;j<w.cols();++j)
+        hidden[j] = (T)Checkpoint_value(hidden_biases, header.dtype, j);
+}
+
+template <typename T>
+bool basic_rbm<T>::Load_checkpoint(const string &name)
+{
+    mapped_file file;
+
+    if(!file.Map(name) || file.size() < sizeof(checkpoint_header))
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Checkpoint not readable : "<<name<<"\n");
+        return FALSE;
+    }
+
+    checkpoint_header header;
+    memcpy(&header, file.data(), sizeof(header));
+
+    /* Parameters of either precision load; a different one is converted.
+       Version 1 carries a bias row, column and particle bit */
+    const uint64_t legacy = (header.version == 1)? 1 : 0;
+    size_t element = (header.dtype == CHECKPOINT_FLOAT32)? sizeof(float) : sizeof(double);
+    uint64_t weight_bytes = header.weight_rows*header.weight_stride*element;
+    uint64_t bias_bytes = legacy? 0 : Bias_block_bytes(header.num_visible, header.num_hidden, element);
+    uint64_t param_bytes = legacy? weight_bytes : Align_offset(weight_bytes) + bias_bytes;
+    uint64_t particle_words = (header.num_hidden + legacy + 63)/64;
+
+    if(memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0
+       || (header.version != CHECKPOINT_VERSION && !legacy)
+       || (header.dtype != CHECKPOINT_FLOAT64 && header.dtype != CHECKPOINT_FLOAT32)
+       || header.num_visible == 0 || header.num_hidden == 0
+       || header.num_visible > file.size() || header.num_hidden > file.size()
+       || header.weight_rows != header.num_visible + legacy
+       || header.weight_cols != header.num_hidden + legacy
+       || header.weight_stride < header.weight_cols
+       || header.weight_rows > file.size()/element/header.weight_stride
+       || header.epochs > file.size()/sizeof(double)
+       || header.weight_offset % MATRIX_ALIGN != 0
+       || header.weight_offset + weight_bytes > file.size()
+       || (!legacy
+           && (header.bias_offset != Align_offset(header.weight_offset + weight_bytes)
+               || header.error_offset < header.bias_offset + bias_bytes))
+       || header.error_offset < header.weight_offset + weight_bytes
+       || header.error_offset + header.epochs*sizeof(double) > file.size()
+       || header.curr_epoch > header.epochs
+       || (header.particle_rows
+           && (header.particle_offset % MATRIX_ALIGN != 0
+               || header.particle_offset < header.error_offset + header.epochs*sizeof(double)
+               || header.particle_rows > file.size()/sizeof(uint64_t)
+               || header.particle_offset + header.particle_rows*particle_words*sizeof(uint64_t)
+                  > file.size()))
+       || (header.velocity_offset
+           && (header.velocity_offset % MATRIX_ALIGN != 0
+               || header.velocity_offset < header.error_offset + header.epochs*sizeof(double)
+               || header.velocity_offset + param_bytes > file.size())))
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid checkpoint : "<<name<<"\n");
+        return FALSE;
+    }
+
+    num_visible = header.num_visible;
+    num_hidden = header.num_hidden;
+    learning_rate = header.learning_rate;
+    curr_rate = learning_rate;
+    standard_deviation = header.standard_deviation;
+
+    epochs = (uint32_t)header.epochs;
+    curr_epoch = (uint32_t)header.curr_epoch;
+    start_epoch = curr_epoch;
+    update_count = header.update_count;
+    seed = header.seed;
+    draws = header.draws;
+
+    const double *history = reinterpret_cast<const double *>(file.data() + header.error_offset);
+    error.assign(history, history + header.epochs);
+
+    if(header.cd_steps)
+        cd_steps = header.cd_steps;
+
+    /* The fantasy particles continue their chains where they stopped;
+       version 1 states drop their leading bias bit */
+    num_particles = header.particle_rows;
+    particles_ready = FALSE;
+    if(num_particles)
+    {
+        particle_states.resize(num_particles, num_hidden);
+        size_t row_bytes = particle_words*sizeof(uint64_t);
+        for(uint64_t p=0;p<num_particles;++p)
+        {
+            const uint64_t *src = reinterpret_cast<const uint64_t *>(file.data() + header.particle_offset
+                                                                     + p*row_bytes);
+            uint64_t *dst = particle_states.row(p);
+
+            if(!legacy)
+                memcpy(dst, src, row_bytes);
+            else
+                for(size_t w=0;w<particle_states.words_per_row();++w)
+                    dst[w] = (src[w] >> 1) | ((w+1 < particle_words)? src[w+1] << 63 : 0);
+        }
+        particles_ready = TRUE;
+    }
+
+    /* The momentum buffer is copied: it is rewritten every update */
+    try
+    {
+        if(header.velocity_offset)
+        {
+            velocity.resize(num_visible, num_hidden);
+            Convert_checkpoint_params(file.data() + header.velocity_offset, header,
+                                      velocity.weights, velocity.visible, velocity.hidden);
+        }
+        else
+            velocity.resize(0, 0);
+    }
+    catch(const std::bad_alloc &)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for the velocity of : "<<name<<"\n");
+        return FALSE;
+    }
+
+    /* Parameters of the model's precision are used straight from the mapped pages */
+    if(!legacy && header.dtype == Checkpoint_dtype(weights.data()))
+    {
+        char *biases = file.data() + header.bias_offset;
+
+        weights.attach(reinterpret_cast<T *>(file.data() + header.weight_offset),
+                       num_visible, num_hidden, header.weight_stride);
+        visible_bias.attach(reinterpret_cast<T *>(biases), 1, num_visible, num_visible);
+        hidden_bias.attach(reinterpret_cast<T *>(biases + Align_offset(num_visible*sizeof(T))),
+                           1, num_hidden, num_hidden);
+        checkpoint_map.swap(file);
+    }
+    else
+    {
+        try
+        {
+            weights.resize(num_visible, num_hidden);
+            visible_bias.resize(1, num_visible);
+            hidden_bias.resize(1, num_hidden);
+            checkpoint_map.Unmap();
+        }
+        catch(const std::bad_alloc &)
+        {
+            RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for the weights of : "<<name<<"\n");
+            return FALSE;
+        }
+
+        Convert_checkpoint_params(file.data() + header.weight_offset, header,
+                                  weights, visible_bias, hidden_bias);
+    }
+
+    Set_netstat(TRUE);
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Checkpoint loaded : "<<name
+                                   <<"\n Number of Hidden Neurons  : "<<num_hidden
+                                   <<"\n Number of Visible Neurons : "<<num_visible
+                                   <<"\n Learning Rate             : "<<learning_rate
+                                   <<"\n Resuming at epoch         : "<<curr_epoch+1<<"\n");
+    return TRUE;
+}
+
+template <typename T>
+inline bool basic_rbm<T>::Check_file(const string &name)
+{
+  struct stat buffer;
+  return (stat (name.c_str(), &buffer) == 0);
+}
+
+
+template <typename T>
+bool basic_rbm<T>::Get_netstat()
+{
+    return net_stat;
+}
+
+template <typename T>
+uint64_t basic_rbm<T>::Get_num_visible() const
+{
+    return num_visible;
+}
+
+template <typename T>
+uint64_t basic_rbm<T>::Get_num_hidden() const
+{
+    return num_hidden;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_netstat(bool data)
+{
+    net_stat=data;
+
+}
+
+template <typename T>
+void basic_rbm<T>::Set_ready_to_train(bool data)
+{
+    ready_to_train = data;
+}
+
+template <typename T>
+bool basic_rbm<T>::Get_ready_to_train()
+{
+    return ready_to_train;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_threads(unsigned count)
+{
+    /* 0 uses every hardware thread */
+    if(count == 0)
+        count = std::thread::hardware_concurrency();
+
+    num_threads = (count == 0)? 1 : count;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_workspace(workspace_arena *arena)
+{
+    /* NULL goes back to the model's own arena */
+    workspace = arena? arena : &own_workspace;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_huge_pages(bool enable)
+{
+    workspace->set_huge_pages(enable);
+}
+
+template <typename T>
+void basic_rbm<T>::Set_batch_size(uint64_t size)
+{
+    /* 0 trains on the full data set (or on each streamed block) per weight update */
+    batch_size = size;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_block_size(uint64_t size)
+{
+    /* Rows of a streamed data source held in memory at once; 0 uses DATA_BLOCK_ROWS */
+    block_size = size;
+}
+
+template <typename T>
+bool basic_rbm<T>::Init_RBM(uint64_t no_hidden, uint64_t no_visible, double alpha)
+{
+    if(no_hidden <=0 || no_visible <=0 || no_hidden >= SIZE_MAX || no_visible >= SIZE_MAX)
+    {
+       Set_netstat(FALSE);
+       return FALSE;
+     }
+    else
+    {
+        num_hidden = no_hidden;
+        num_visible = no_visible;
+        learning_rate = alpha;
+        curr_rate = alpha;
+        Set_netstat(TRUE);
+
+        RBM_LOG(log_stream, LOG_DEBUG, "\n Number of Hidden Neurons  : "<<num_hidden
+                                       <<"\n Number of Visible Neurons : "<<num_visible
+                                       <<"\n Learning Rate             : "<<learning_rate
+                                       <<"\n");
+    }
+
+    return TRUE;
+}
+
+template <typename T>
+bool basic_rbm<T>::Init_weights(char *type)
+{
+    if(Get_netstat())
+    {
+        try
+        {
+            weights.resize(num_visible, num_hidden);
+            visible_bias.resize(1, num_visible);
+            hidden_bias.resize(1, num_hidden);
+            velocity.resize(0, 0);
+        }
+        catch(const std::bad_alloc &)
+        {
+            RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for "<<num_visible
+                                           <<" * "<<num_hidden<<" weights\n");
+            return FALSE;
+        }
+
+        for(uint64_t i=0; i<num_visible;++i)
+        {
+            T *w = weights.row(i);
+            for(uint64_t j=0; j<num_hidden;++j)
+             {
+                w[j] = standard_deviation*generate_random(0.0,1.0);
+
+             }
+        }
+
+        /* Biases start at zero unless Init_bias("random") asked otherwise */
+        if(bias_init_type == 1)
+        {
+            for(uint64_t i=0; i<num_visible;++i)
+                visible_bias(0, i) = standard_deviation*generate_random(0.0,1.0);
+            for(uint64_t j=0; j<num_hidden;++j)
+                hidden_bias(0, j) = standard_deviation*generate_random(0.0,1.0);
+        }
+     }
+
+    else
+    {
+         RBM_LOG(log_stream, LOG_ERROR, "\n Error: RBM haven't been initialized yet!! \n");
+
+         return FALSE;
+    }
+
+    return TRUE;
+}
+
+template <typename T>
+bool basic_rbm<T>::Init_bias(char *type)
+{
+    if(Get_netstat())
+    {
+        if((!strcmp(type,"zeros")))
+        {
+            bias_init_type = 0;
+        }
+
+        else if((!strcmp(type,"random")))
+        {
+            bias_init_type = 1;
+        }
+        else
+        {
+            RBM_LOG(log_stream, LOG_ERROR, " Error: Invalid input argument for Init_bias()\n");
+
+            return FALSE;
+        }
+    }
+    else
+    {
+         RBM_LOG(log_stream, LOG_ERROR, "\n Error: RBM haven't been initialized yet!! \n");
+
+         return FALSE;
+    }
+
+    return TRUE;
+}
+
+template <typename T>
+void basic_rbm<T>::Measure_density()
+{
+    /* Fraction of ones in the data, which picks the positive phase kernels */
+    uint64_t rows = sparse_input? sparse_data.rows() : data.rows();
+    uint64_t ones = sparse_input? sparse_data.count_ones() : data.count_ones();
+
+    if(byte_input)
+    {
+        rows = byte_data.rows();
+        ones = 0;
+        for(uint64_t i=0;i<rows;++i)
+        {
+            const uint8_t *r = byte_data.row(i);
+            for(uint64_t j=0;j<num_visible;++j)
+                ones += (r[j]!= 0);
+        }
+    }
+
+    data_density = (rows && num_visible)? (double)ones/((double)rows*num_visible) : 0.0;
+}
+
+template <typename T>
+inline void basic_rbm<T>::Config_batch()
+{
+    /* Rows per weight update; the last batch of an epoch may be shorter */
+    batch_rows = (batch_size == 0 || batch_size > train_data_rows)? train_data_rows : batch_size;
+    curr_batch_rows = batch_rows;
+
+    row_order.resize(train_data_rows);
+    for(uint64_t i=0;i<train_data_rows;++i)
+        row_order[i] = i;
+
+    if(sparse_input)
+        curr_sparse = (batch_rows < train_data_rows)? &sparse_batch : &sparse_data;
+    else if(batch_rows < train_data_rows || byte_input)
+        curr_batch = &batch_data;
+    else
+        curr_batch = &data;
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Batch size : "<<batch_rows<<" of "<<train_data_rows<<" rows\n");
+}
+
+template <typename T>
+void basic_rbm<T>::Config_threads()
+{
+    if(!pool || pool->size() != num_threads)
+        pool.reset(new thread_pool(num_threads));
+
+    size_t workers = pool->size();
+
+    /* Per-slice partial sums; slice 0 writes into the final matrices.
+       Their buffers are carved by Config_workspace() */
+    size_t slices = Gradient_slices((num_particles > batch_rows)? num_particles : batch_rows);
+    partial_error.resize(slices);
+    partial_gradients.resize(slices-1);
+    monitor_input.resize(monitor_every? workers : 0);
+    monitor_output.resize(monitor_every? workers : 0);
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Training threads : "<<workers<<"\n");
+}
+
+template <typename T>
+void basic_rbm<T>::Shuffle_rows()
+{
+    /* Fisher-Yates shuffle of the row visiting order, restarted from the
+       identity so the order depends only on the generator position */
+    for(uint64_t i=0;i<train_data_rows;++i)
+        row_order[i] = i;
+
+    for(uint64_t i=train_data_rows-1;i>0;--i)
+    {
+        uint64_t j = (uint64_t)generate_random(0.0, i+1.0);
+        if(j > i)
+            j = i;
+        std::swap(row_order[i], row_order[j]);
+    }
+}
+
+template <typename T>
+void basic_rbm<T>::Shuffle_blocks(uint64_t blocks)
+{
+    /* Fisher-Yates shuffle of the block visiting order, as in Shuffle_rows() */
+    block_order.resize(blocks);
+    for(uint64_t i=0;i<blocks;++i)
+        block_order[i] = i;
+
+    for(uint64_t i=blocks-1;i>0;--i)
+    {
+        uint64_t j = (uint64_t)generate_random(0.0, i+1.0);
+        if(j > i)
+            j = i;
+        std::swap(block_order[i], block_order[j]);
+    }
+}
+
+template <typename T>
+bool basic_rbm<T>::Read_block(uint64_t index, bit_matrix &out)
+{
+    uint64_t first = index*row_order.size();
+    uint64_t count = source->rows() - first;
+    if(count > row_order.size())
+        count = row_order.size();
+
+    return source->Read_rows(first, count, out);
+}
+
+template <typename T>
+bool basic_rbm<T>::Train_epoch()
+{
+    if(!source)
+    {
+        Train_rows();
+        return TRUE;
+    }
+
+    /* Blocks are visited in random order; the next block is read on a
+       separate thread while the current one trains */
+    const uint64_t rows = row_order.size();
+    const uint64_t blocks = (source->rows() + rows - 1)/rows;
+
+    if(blocks == 0)
+        return TRUE;
+
+    Shuffle_blocks(blocks);
+
+    std::future<bool> pending = std::async(std::launch::async, &basic_rbm::Read_block, this,
+                                           block_order[0], std::ref(next_block));
+
+    for(uint64_t b=0;b<blocks;++b)
+    {
+        bool ok = pending.get();
+        data.swap(next_block);
+
+        if(b+1 < blocks)
+            pending = std::async(std::launch::async, &basic_rbm::Read_block, this,
+                                 block_order[b+1], std::ref(next_block));
+
+        if(!ok)
+        {
+            if(pending.valid())
+                pending.wait();
+            return FALSE;
+        }
+
+        train_data_rows = data.rows();
+        Measure_density();
+        Train_rows();
+    }
+
+    return TRUE;
+}
+
+template <typename T>
+void basic_rbm<T>::Train_rows()
+{
+    if (batch_rows < train_data_rows)
+        Shuffle_rows();
+
+    /* One weight update per batch */
+    for (uint64_t first = 0;first < train_data_rows;first += batch_rows)
+    {
+        Load_batch(first);
+        Train_batch();
+    }
+}
+
+template <typename T>
+void basic_rbm<T>::Load_batch(uint64_t first)
+{
+    batch_first = first;
+    curr_batch_rows = (train_data_rows - first < batch_rows)? train_data_rows - first : batch_rows;
+
+    if(sparse_input)
+    {
+        if(curr_sparse == &sparse_data)
+            return;
+
+        /* Gather the batch rows' indices; capacity is kept across batches */
+        sparse_batch.clear(sparse_data.cols());
+        for(uint64_t i=0;i<curr_batch_rows;++i)
+        {
+            uint64_t r = row_order[first+i];
+            const uint32_t *cols = sparse_data.row(r);
+            for(size_t p=0;p<sparse_data.row_size(r);++p)
+                sparse_batch.add(cols[p]);
+            sparse_batch.end_row();
+        }
+        return;
+    }
+
+    if(curr_batch == &data)
+        return;
+
+    /* Byte views are packed as they are gathered, so the batch is all
+       that ever exists in bits */
+    if(byte_input)
+    {
+        for(uint64_t i=0;i<curr_batch_rows;++i)
+            Pack_bytes(byte_data.row(row_order[first+i]), num_visible, batch_data.row(i));
+        return;
+    }
+
+    /* Gather the batch rows, a few words each */
+    size_t nwords = data.words_per_row();
+    for(uint64_t i=0;i<curr_batch_rows;++i)
+        memcpy(batch_data.row(i), data.row(row_order[first+i]), nwords*sizeof(uint64_t));
+}
+
+template <typename T>
+inline void basic_rbm<T>::Config_probs()
+{
+    /* Configuring the Positive Hidden Probabilities */
+    workspace->carve(pos_hidden_probs, batch_rows, num_hidden);
+    /* Configuring the Negative Hidden Probabilities (the chain of CD only) */
+    workspace->carve(neg_hidden_probs, num_particles? 0 : batch_rows, num_hidden);
+    /* Configuring the Negative Visible Probabilities */
+    workspace->carve(neg_visible_probs, batch_rows, num_visible);
+}
+
+template <typename T>
+void basic_rbm<T>::Config_particles()
+{
+    /* Particles survive between RBM_train calls while their shape holds */
+    if(particle_states.rows() != num_particles || particle_states.cols() != num_hidden)
+    {
+        particle_states.resize(num_particles, num_hidden);
+        particles_ready = FALSE;
+    }
+
+    if(num_particles)
+        RBM_LOG(log_stream, LOG_DEBUG, "\n PCD fantasy particles : "<<num_particles
+                                       <<" * "<<num_hidden<<", "<<cd_steps<<" steps per update\n");
+}
+
+template <typename T>
+inline void basic_rbm<T>::Config_associations()
+{
+    /* The velocity survives between runs and checkpoints; it starts at
+       zero when momentum is first used */
+    if(momentum == 0.0)
+        velocity.resize(0, 0);
+    else if(velocity.rows() != weights.rows() || velocity.weights.cols() != weights.cols())
+        velocity.resize(weights.rows(), weights.cols());
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Gradient dimension : "<<num_visible
+                                   <<" * "<<num_hidden<<" and biases\n");
+}
+
+template <typename T>
+inline void basic_rbm<T>::Config_hiddden_states()
+{
+    /* Configuring the Positive Hidden Activations */
+    workspace->carve(pos_hidden_states, batch_rows, num_hidden);
+}
+
+template <typename T>
+void basic_rbm<T>::Config_workspace()
+{
+    const size_t workers = pool->size();
+
+    /* Every per-run buffer comes from the arena: a pass that does not fit
+       only measures, and the arena grows to that size once */
+    for(int pass=0;pass<2;++pass)
+    {
+        workspace->begin();
+
+        Config_probs();
+        Config_hiddden_states();
+
+        workspace->carve(batch_data, (curr_batch == &batch_data)? batch_rows : 0, num_visible);
+        workspace->carve(particle_visible_probs, num_particles, num_visible);
+        workspace->carve(particle_hidden_probs, num_particles, num_hidden);
+
+        /* Both phases accumulate into one gradient */
+        workspace->carve(gradient.weights, num_visible, num_hidden);
+        workspace->carve(gradient.visible, 1, num_visible);
+        workspace->carve(gradient.hidden, 1, num_hidden);
+        for(size_t i=0;i<partial_gradients.size();++i)
+        {
+            workspace->carve(partial_gradients[i].weights, num_visible, num_hidden);
+            workspace->carve(partial_gradients[i].visible, 1, num_visible);
+            workspace->carve(partial_gradients[i].hidden, 1, num_hidden);
+        }
+
+        /* Per-worker uniforms and phase timers, one cache line each */
+        workspace->carve(uniforms, workers, num_hidden);
+        workspace->carve(phase_busy, workers, PHASE_COUNT);
+
+        /* Monitor tiles, only while monitoring */
+        for(size_t i=0;i<monitor_input.size();++i)
+        {
+            workspace->carve(monitor_input[i], GIBBS_TILE_ROWS, num_visible);
+            workspace->carve(monitor_output[i], GIBBS_TILE_ROWS, num_visible);
+        }
+
+        if(workspace->fits())
+            break;
+
+        workspace->reserve(workspace->used_bytes());
+    }
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Workspace : "<<workspace->used_bytes()<<" of "
+                                   <<workspace->bytes()<<" bytes"
+                                   <<"\n Pos_Hidden_Probs dimension : "<<pos_hidden_probs.rows()
+                                   <<" * "<<pos_hidden_probs.cols()
+                                   <<"\n Neg_Hidden_Probs dimension : "<<neg_hidden_probs.rows()
+                                   <<" * "<<neg_hidden_probs.cols()
+                                   <<"\n Neg_Visible_Probs dimension: "<<neg_visible_probs.rows()
+                                   <<" * "<<neg_visible_probs.cols()
+                                   <<"\n Pos_Hidden_States dimension : "<<pos_hidden_states.rows()
+                                   <<" * "<<pos_hidden_states.cols()<<"\n");
+}
+
+template <typename T>
+inline void basic_rbm<T>::Compute_pos_hidden_probs(uint64_t first, uint64_t count, size_t worker)
+{
+    RBM_LOG(log_stream, LOG_TRACE, "\n Data dimensions: "<<data.rows()<<" * "
+                                   <<data.cols()
+                                   <<"\n Weight dimensions: "<<weights.rows()<<" * "
+                                   <<weights.cols()
+                                   <<"\n");
+
+    /* Hidden biases + Data * Weights, written straight into the probability rows */
+    const T *bias = hidden_bias.data();
+
+    if(sparse_input)
+        Sparse_row_sum(count, *curr_sparse, first, weights.data(), weights.row_stride(), num_hidden,
+                       bias, pos_hidden_probs.row(first), pos_hidden_probs.row_stride());
+    else if(data_density < MASKED_DENSITY_LIMIT)
+        Masked_row_sum(count, *curr_batch, first, weights.data(), weights.row_stride(), num_hidden,
+                       bias, pos_hidden_probs.row(first), pos_hidden_probs.row_stride());
+    else
+    {
+        Broadcast_rows(count, bias, num_hidden, pos_hidden_probs.row(first), pos_hidden_probs.row_stride());
+        Gemm(false, false, count, num_hidden, num_visible,
+             1.0, *curr_batch, first, weights.data(), weights.row_stride(),
+             1.0, pos_hidden_probs.row(first), pos_hidden_probs.row_stride());
+    }
+
+    /* Logistic in place and Bernoulli sample while the tile is in cache */
+    const simd_kernels<T> &simd = Simd<T>();
+    for(uint64_t i=first;i<first+count;++i)
+        simd.logistic(pos_hidden_probs.row(i), pos_hidden_probs.row(i), pos_hidden_probs.cols());
+
+    Compute_hidden_states(pos_hidden_probs, pos_hidden_states, first, count, worker,
+                          RNG_STREAM_HIDDEN, 0, batch_first);
+}
+
+template <typename T>
+inline void basic_rbm<T>::Compute_neg_hidden_probs(const dense_matrix<T> &visible, dense_matrix<T> &hidden,
+                                          uint64_t first, uint64_t count)
+{
+    RBM_LOG(log_stream, LOG_TRACE, "\n Neg_Visible_Probs dimensions: "<<visible.rows()
+                                   <<" * "<<visible.cols()
+                                   <<"\n Weight dimensions: "<<weights.rows()<<" * "
+                                   <<weights.cols()
+                                   <<"\n");
+
+    /* Hidden biases + Negative Visible Probabilities * Weights, then logistic in place */
+    Broadcast_rows(count, hidden_bias.data(), num_hidden, hidden.row(first), hidden.row_stride());
+    Gemm(false, false, count, num_hidden, num_visible,
+         1.0, visible.row(first), visible.row_stride(),
+         weights.data(), weights.row_stride(),
+         1.0, hidden.row(first), hidden.row_stride());
+
+    const simd_kernels<T> &simd = Simd<T>();
+    for(uint64_t i=first;i<first+count;++i)
+        simd.logistic(hidden.row(i), hidden.row(i), hidden.cols());
+}
+
+template <typename T>
+inline void basic_rbm<T>::Compute_pos_associations(uint64_t first, uint64_t count, rbm_gradient<T> &grad)
+{
+     dense_matrix<T> &assoc = grad.weights;
+
+     /* Transpose(data) * Positive Hidden Probabilities over rows [first, first+count) */
+     if(sparse_input)
+         Sparse_transpose_accumulate(count, *curr_sparse, first,
+                                     pos_hidden_probs.row(first), pos_hidden_probs.row_stride(),
+                                     pos_hidden_probs.cols(),
+                                     assoc.data(), assoc.row_stride());
+     else if(data_density < MASKED_DENSITY_LIMIT)
+         Masked_transpose_accumulate(count, *curr_batch, first,
+                                     pos_hidden_probs.row(first), pos_hidden_probs.row_stride(),
+                                     pos_hidden_probs.cols(),
+                                     assoc.data(), assoc.row_stride());
+     else
+         Gemm(true, false, num_visible, pos_hidden_probs.cols(), count,
+              1.0, *curr_batch, first, pos_hidden_probs.row(first), pos_hidden_probs.row_stride(),
+              0.0, assoc.data(), assoc.row_stride());
+
+     /* Bias gradients: ones per visible column and the hidden probability sums */
+     if(sparse_input)
+         Column_count(count, *curr_sparse, first, grad.visible.data());
+     else
+         Column_count(count, *curr_batch, first, grad.visible.data());
+
+     const simd_kernels<T> &simd = Simd<T>();
+     T *hidden = grad.hidden.data();
+     memset(hidden, 0, num_hidden*sizeof(T));
+     for(uint64_t i=first;i<first+count;++i)
+         simd.accumulate(pos_hidden_probs.row(i), hidden, num_hidden);
+}
+
+template <typename T>
+inline void basic_rbm<T>::Compute_neg_associations(const dense_matrix<T> &visible, const dense_matrix<T> &hidden,
+                                          uint64_t first, uint64_t count, double scale,
+                                          rbm_gradient<T> &grad)
+{
+     RBM_LOG(log_stream, LOG_TRACE, "\n Transpose(Neg_visible_Probs) dimensions: "<<visible.cols()
+                                   <<" * "<<visible.rows()
+                                   <<"\n Pos_hidden_Probs dimensions: "<<hidden.rows()
+                                   <<" * "<<hidden.cols()
+                                   <<"\n");
+
+     /* assoc -= scale * Transpose(Negative Visible Probabilities) * Negative Hidden Probabilities
+        over rows [first, first+count), on top of the positive associations */
+     Gemm(true, false, visible.cols(), hidden.cols(), count,
+          -scale, visible.row(first), visible.row_stride(),
+          hidden.row(first), hidden.row_stride(),
+          1.0, grad.weights.data(), grad.weights.row_stride());
+
+     /* Bias gradients lose the scaled column sums of both layers */
+     T *visible_sum = grad.visible.data();
+     T *hidden_sum = grad.hidden.data();
+     for(uint64_t i=first;i<first+count;++i)
+     {
+         const T *v = visible.row(i);
+         const T *h = hidden.row(i);
+         for(uint64_t j=0;j<visible.cols();++j)
+             visible_sum[j] -= scale*v[j];
+         for(uint64_t j=0;j<hidden.cols();++j)
+             hidden_sum[j] -= scale*h[j];
+     }
+}
+
+template <typename T>
+inline void basic_rbm<T>::Compute_neg_visible_probs(const bit_matrix &states, dense_matrix<T> &visible,
+                                           uint64_t first, uint64_t count)
+{
+    RBM_LOG(log_stream, LOG_TRACE, "\n Pos_hidden_States dimensions: "<<states.rows()
+                                   <<" * "<<states.cols()
+                                   <<"\n Transpose(Weights) dimensions: "<<weights.cols()
+                                   <<" * "<<weights.rows()
+                                   <<"\n");
+
+    /* Visible biases + Hidden states * Transpose(Weights), then logistic in place */
+    Broadcast_rows(count, visible_bias.data(), num_visible, visible.row(first), visible.row_stride());
+    Gemm(false, true, count, num_visible, num_hidden,
+         1.0, states, first,
+         weights.data(), weights.row_stride(),
+         1.0, visible.row(first), visible.row_stride());
+
+    const simd_kernels<T> &simd = Simd<T>();
+    for(uint64_t i=first;i<first+count;++i)
+        simd.logistic(visible.row(i), visible.row(i), visible.cols());
+}
+
+template <typename T>
+void basic_rbm<T>::Compute_hidden_states(const dense_matrix<T> &probs, bit_matrix &states,
+                                uint64_t first, uint64_t count, size_t worker,
+                                uint32_t stream, uint32_t step, uint64_t stream_row)
+{
+    const simd_kernels<T> &simd = Simd<T>();
+    T *u = uniforms.row(worker);
+
+    /* Stream per (purpose, Gibbs step, weight update, row) */
+    for(uint64_t i=first;i<first+count;++i)
+    {
+        Fill_uniform(stream, step, update_count, stream_row+i, u, states.cols());
+
+        /* Bernoulli sample of the whole row as a bitmask */
+        simd.sample(probs.row(i), u, states.cols(), states.row(i));
+    }
+}
+
+template <typename T>
+void basic_rbm<T>::Advance_particles(uint64_t first, uint64_t count, size_t worker)
+{
+    /* k Gibbs steps of every fantasy particle, one tile at a time; the
+       last hidden sample is kept for the next weight update */
+    for(uint64_t t=first;t<first+count;t+=GIBBS_TILE_ROWS)
+    {
+        uint64_t n = (first+count-t < GIBBS_TILE_ROWS)? first+count-t : GIBBS_TILE_ROWS;
+
+        for(uint32_t k=0;k<cd_steps;++k)
+        {
+            Compute_neg_visible_probs(particle_states, particle_visible_probs, t, n);
+            Compute_neg_hidden_probs(particle_visible_probs, particle_hidden_probs, t, n);
+            Compute_hidden_states(particle_hidden_probs, particle_states, t, n, worker,
+                                  RNG_STREAM_PARTICLE, k, 0);
+        }
+    }
+}
+
+template <typename T>
+void basic_rbm<T>::Init_particles()
+{
+    /* Particles start from the hidden samples of the first batch */
+    for(uint64_t p=0;p<particle_states.rows();++p)
+        memcpy(particle_states.row(p), pos_hidden_states.row(p % curr_batch_rows),
+               particle_states.words_per_row()*sizeof(uint64_t));
+
+    particles_ready = TRUE;
+}
+
+/*void RBM::Compute_pos_visible_states()
+{
+	for (uint64_t i = 0;i<data.size();++i)
+	{
+		data[0][i] = TRUE;
+		for (uint64_t j = 1;j<data[0].size();++j)
+		{
+			data[i][j] = (pos_visible_probs[i][j] > generate_random(0.0, 1.0)) ? TRUE : FALSE;
+		}
+	}
+}*/
+
+template <typename T>
+bool basic_rbm<T>::RBM_train(uint32_t epchs, bool method)
+{
+    epochs = epchs;
+    uint64_t nrows = sparse_input? sparse_data.rows() : data.rows();
+    uint64_t ncols = sparse_input? sparse_data.cols() : data.cols();
+
+    if(byte_input)
+    {
+        nrows = byte_data.rows();
+        ncols = byte_data.cols();
+    }
+
+    /* A streamed source is trained one block of rows at a time */
+    if(source)
+    {
+        uint64_t rows = block_size? block_size : DATA_BLOCK_ROWS;
+        nrows = (source->rows() < rows)? source->rows() : rows;
+        ncols = source->cols();
+    }
+
+    train_data_rows = nrows;
+    train_data_cols = ncols;
+
+    RBM_LOG(log_stream, LOG_DEBUG, "\n RBM Data dimensions  : "<<train_data_rows<<" * "<<train_data_cols
+                                   <<"\n Weight dimensions: "<<num_visible<<" * "<<num_hidden<<"\n");
+
+    if(source)
+        RBM_LOG(log_stream, LOG_DEBUG, "\n Streaming "<<source->rows()<<" rows in blocks of "
+                                       <<train_data_rows<<"\n");
+    else
+    {
+        RBM_LOG(log_stream, LOG_INFO, "\n Initial RBM Data \n");
+        Display_data();
+    }
+
+    if(ncols!= (num_visible))
+    {
+        RBM_LOG(log_stream, LOG_ERROR, " Error: Invalid data dimensions\n");
+
+        return FALSE;
+    }
+
+    else
+    {
+        if(Get_netstat())
+        {
+            /* The data is only read; biases are added inside the kernels */
+            if(!source)
+                Measure_density();
+
+            Display_weights();
+
+            /** Configure RBM Parameters **/
+            try
+            {
+                Config_batch();
+                Config_associations();
+                Config_particles();
+                Config_threads();
+                Config_workspace();
+                Config_error();
+                Set_ready_to_train(TRUE);
+            }
+            catch(const std::bad_alloc &)
+            {
+                RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for "<<train_data_rows
+                                               <<" * "<<train_data_cols<<" training buffers\n");
+                Set_ready_to_train(FALSE);
+
+                return FALSE;
+            }
+			
+            if(Get_ready_to_train())
+            {
+
+				/** Train Data **/
+				RBM_LOG(log_stream, LOG_DEBUG, "\n Training RBM ...\n\n");
+
+				train_clock::time_point start_time = train_clock::now();
+
+				memset(&total_stats, 0, sizeof(total_stats));
+				monitor_best = HUGE_VAL;
+				monitor_best_epoch = 0;
+				monitor_wait = 0;
+
+				/* A loaded checkpoint resumes at its saved epoch */
+				for(curr_epoch=start_epoch;curr_epoch<epochs;++curr_epoch)
+                {
+
+					RBM_LOG(log_stream, LOG_DEBUG, "\n Epoch : "<<curr_epoch+1
+					                               <<"\n");
+
+					curr_rate = Scheduled_rate(curr_epoch);
+
+					error[curr_epoch] = 0.0;
+
+					memset(&epoch_stats, 0, sizeof(epoch_stats));
+					epoch_stats.epoch = curr_epoch + 1;
+					epoch_stats.bytes_allocated = Training_bytes();
+					train_clock::time_point epoch_start = train_clock::now();
+
+					if (!Train_epoch())
+					{
+						RBM_LOG(log_stream, LOG_ERROR, "\n Error: Data source read failed\n");
+						log_stream.Flush();
+
+						return FALSE;
+					}
+
+					/* Whatever the phases did not claim went to batching and reads */
+					epoch_stats.seconds = Seconds_since(epoch_start);
+					epoch_stats.other_seconds = epoch_stats.seconds;
+					for (size_t p=0;p<PHASE_COUNT;++p)
+						epoch_stats.other_seconds -= epoch_stats.phase_seconds[p];
+					if (epoch_stats.other_seconds < 0.0)
+						epoch_stats.other_seconds = 0.0;
+					epoch_stats.error = error[curr_epoch];
+
+					total_stats.epoch += 1;
+					total_stats.seconds += epoch_stats.seconds;
+					for (size_t p=0;p<PHASE_COUNT;++p)
+						total_stats.phase_seconds[p] += epoch_stats.phase_seconds[p];
+					total_stats.other_seconds += epoch_stats.other_seconds;
+					total_stats.rows += epoch_stats.rows;
+					total_stats.updates += epoch_stats.updates;
+					total_stats.flops += epoch_stats.flops;
+					if (epoch_stats.bytes_allocated > total_stats.bytes_allocated)
+						total_stats.bytes_allocated = epoch_stats.bytes_allocated;
+					total_stats.error = epoch_stats.error;
+
+					/* Held-out evaluation every monitor_every epochs; patience ends the run.
+					   Between evaluations the last results carry over */
+					bool stop = FALSE;
+					if (monitor_every)
+					{
+						if ((curr_epoch + 1) % monitor_every == 0)
+							stop = Monitor();
+						else
+						{
+							error[curr_epoch] = curr_epoch? error[curr_epoch-1] : 0.0;
+							epoch_stats.valid_error = total_stats.valid_error;
+							epoch_stats.free_energy_gap = total_stats.free_energy_gap;
+						}
+
+						epoch_stats.error = error[curr_epoch];
+						total_stats.error = epoch_stats.error;
+						total_stats.valid_error = epoch_stats.valid_error;
+						total_stats.free_energy_gap = epoch_stats.free_energy_gap;
+					}
+
+					RBM_LOG(log_stream, LOG_DEBUG, " Epoch time : "<<epoch_stats.seconds<<" s, "
+					                               <<epoch_stats.rows/epoch_stats.seconds<<" rows/s\n");
+					Write_stats(epoch_stats, "epoch");
+
+					if (checkpoint_every && (curr_epoch + 1) % checkpoint_every == 0)
+						Write_checkpoint(checkpoint_name, curr_epoch + 1);
+
+					if (stop)
+					{
+						RBM_LOG(log_stream, LOG_INFO, "\n Early stopping after epoch "<<curr_epoch+1
+						                              <<", best validation error "<<monitor_best
+						                              <<" at epoch "<<monitor_best_epoch<<"\n");
+						epochs = curr_epoch + 1;
+						error.resize(epochs);
+						break;
+					}
+                }
+
+				start_epoch = 0;
+
+				/* Monotonic and unbounded in hours, unlike a calendar time */
+				double elapsed = Seconds_since(start_time);
+				uint64_t whole = (uint64_t)elapsed;
+
+				Write_stats(total_stats, "total");
+
+				RBM_LOG(log_stream, LOG_DEBUG, "\n Training Complete \n"
+				                               << "\n Elapsed Time : "
+				                               << whole/3600 << ':'
+				                               << setfill('0') << setw(2) << (whole/60)%60 << ':'
+				                               << setw(6) << std::fixed << setprecision(3)
+				                               << elapsed - (double)(whole - whole%60));
+
+				Display_error(5,"fixed");
+				log_stream.Flush();
+								
+            }
+
+       }
+
+        else
+        {
+            RBM_LOG(log_stream, LOG_ERROR, "\n Error: RBM haven't been initialized yet!! \n");
+
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_cd_steps(uint32_t steps)
+{
+    /* Gibbs steps of the negative chain per weight update (CD-k / PCD-k) */
+    cd_steps = (steps == 0)? 1 : steps;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_optimizer(double mu, bool use_nesterov, double decay)
+{
+    /* mu == 0 is plain SGD; decay is the L2 coefficient on the weights.
+       Each update adds rate*(g - rows*decay*w), g being the gradient summed
+       over the batch's rows: the rate is a per-row step and decay keeps the
+       same weight against the data for any batch size, the short last batch
+       of an epoch included */
+    momentum = (mu < 0.0)? 0.0 : mu;
+    nesterov = use_nesterov;
+    weight_decay = (decay < 0.0)? 0.0 : decay;
+}
+
+template <typename T>
+void basic_rbm<T>::Set_schedule(lr_schedule type, double factor, uint32_t every)
+{
+    /* The learning rate given to Init_RBM is the rate of the first epoch */
+    schedule = type;
+    schedule_factor = factor;
+    schedule_every = every;
+}
+
+template <typename T>
+double basic_rbm<T>::Scheduled_rate(uint32_t epoch) const
+{
+    switch(schedule)
+    {
+        case SCHEDULE_STEP:
+            return schedule_every? learning_rate*pow(schedule_factor, (double)(epoch/schedule_every))
+                                 : learning_rate;
+
+        case SCHEDULE_COSINE:
+        {
+            double progress = epochs? (double)epoch/epochs : 0.0;
+            return learning_rate*(schedule_factor
+                                  + (1.0 - schedule_factor)*0.5*(1.0 + cos(3.14159265358979323846*progress)));
+        }
+
+        default:
+            return learning_rate;
+    }
+}
+
+template <typename T>
+void basic_rbm<T>::Set_pcd(uint64_t particles)
+{
+    /* Persistent fantasy particles for the negative phase; 0 restarts
+       the chain from the data (CD) */
+    if(particles != num_particles)
+        particles_ready = FALSE;
+
+    num_particles = particles;
+}
+
+template <typename T>
+void basic_rbm<T>::Gibbs_sampling(uint64_t first, uint64_t count, size_t worker)
+{
+    /* Rows are independent, so each tile of GIBBS_TILE_ROWS rows runs the
+       whole chain while its probabilities are still in cache */
+    for(uint64_t t=first;t<first+count;t+=GIBBS_TILE_ROWS)
+    {
+        uint64_t n = (first+count-t < GIBBS_TILE_ROWS)? first+count-t : GIBBS_TILE_ROWS;
+        double *busy = phase_busy.row(worker);
+        train_clock::time_point start = train_clock::now();
+
+        // Data is simply the positive visible state
+        Compute_pos_hidden_probs(t, n, worker);
+
+        busy[PHASE_POSITIVE] += Seconds_since(start);
+        start = train_clock::now();
+
+        /* Reconstruction of the visible unit from the hidden units*/
+        Compute_neg_visible_probs(pos_hidden_states, neg_visible_probs, t, n);
+
+        /* With PCD the negative phase runs on the particles instead and the
+           reconstruction only feeds the error */
+        if(num_particles)
+        {
+            busy[PHASE_ERROR] += Seconds_since(start);
+            continue;
+        }
+
+        for(uint32_t k=0;k<cd_steps;++k)
+        {
+            if(k)
+                Compute_neg_visible_probs(pos_hidden_states, neg_visible_probs, t, n);
+
+            Compute_neg_hidden_probs(neg_visible_probs, neg_hidden_probs, t, n);
+
+            /* Sampled hidden states drive the next step of the chain */
+            if(k+1 < cd_steps)
+                Compute_hidden_states(neg_hidden_probs, pos_hidden_states, t, n, worker,
+                                      RNG_STREAM_HIDDEN, k+1, batch_first);
+        }
+
+        busy[PHASE_GIBBS] += Seconds_since(start);
+    }
+}
+
+/* Splits count rows into parts near-equal slices; slice i is [first, first+length) */
+static inline void Row_slice(uint64_t count, size_t parts, size_t i,
+                             uint64_t &first, uint64_t &length)
+{
+    uint64_t base = count/parts, extra = count%parts;
+    first = i*base + ((i < extra)? i : extra);
+    length = base + ((i < extra)? 1 : 0);
+}
+
+template <typename T>
+void basic_rbm<T>::Train_batch()
+{
+    const size_t workers = pool->size();
+
+    /* Gibbs Sampling: rows are independent, so small row chunks are dealt
+       out and stolen between workers */
+    size_t chunks = workers*4;
+    if(chunks > curr_batch_rows)
+        chunks = curr_batch_rows;
+
+    train_clock::time_point start = train_clock::now();
+
+    pool->Parallel_for(chunks, [&](size_t task, size_t worker)
+    {
+        uint64_t first;
+        uint64_t count;
+        Row_slice(curr_batch_rows, chunks, task, first, count);
+        Gibbs_sampling(first, count, worker);
+    });
+
+    Attribute_phases(Seconds_since(start));
+
+    /* PCD: the fantasy particles advance k steps, chunked the same way */
+    if(num_particles)
+    {
+        if(!particles_ready)
+            Init_particles();
+
+        size_t particle_chunks = (workers*4 < num_particles)? workers*4 : num_particles;
+        start = train_clock::now();
+
+        pool->Parallel_for(particle_chunks, [&](size_t task, size_t worker)
+        {
+            uint64_t first;
+            uint64_t count;
+            Row_slice(num_particles, particle_chunks, task, first, count);
+            Advance_particles(first, count, worker);
+        });
+
+        epoch_stats.phase_seconds[PHASE_GIBBS] += Seconds_since(start);
+    }
+
+    /* Gradient: a fixed set of row slices, each into a private partial sum
+       of positive minus negative associations, stolen between workers. The
+       negative phase sums over the particles with PCD, scaled to the batch
+       size so both phases carry the same weight */
+    const dense_matrix<T> &neg_visible = num_particles? particle_visible_probs : neg_visible_probs;
+    const dense_matrix<T> &neg_hidden = num_particles? particle_hidden_probs : neg_hidden_probs;
+    uint64_t neg_rows = num_particles? num_particles : curr_batch_rows;
+    double neg_scale = (double)curr_batch_rows/neg_rows;
+
+    size_t slices = Gradient_slices(curr_batch_rows);
+    size_t neg_slices = Gradient_slices(neg_rows);
+    size_t grad_slices = (slices > neg_slices)? slices : neg_slices;
+
+    start = train_clock::now();
+
+    pool->Parallel_for(grad_slices, [&](size_t task, size_t worker)
+    {
+        rbm_gradient<T> &grad = task? partial_gradients[task-1] : gradient;
+        double *busy = phase_busy.row(worker);
+        train_clock::time_point begin = train_clock::now();
+
+        uint64_t first;
+        uint64_t count;
+
+        if(task < slices)
+        {
+            Row_slice(curr_batch_rows, slices, task, first, count);
+
+            Compute_pos_associations(first, count, grad);
+
+            busy[PHASE_ASSOCIATIONS] += Seconds_since(begin);
+            begin = train_clock::now();
+
+            /* The monitor replaces the training error sweep */
+            partial_error[task] = monitor_every? 0.0 : Update_error(first, count);
+
+            busy[PHASE_ERROR] += Seconds_since(begin);
+            begin = train_clock::now();
+        }
+        else
+        {
+            grad.fill(0.0);
+            partial_error[task] = 0.0;
+        }
+
+        if(task < neg_slices)
+        {
+            Row_slice(neg_rows, neg_slices, task, first, count);
+
+            Compute_neg_associations(neg_visible, neg_hidden, first, count, neg_scale, grad);
+        }
+
+        busy[PHASE_ASSOCIATIONS] += Seconds_since(begin);
+    });
+
+    Attribute_phases(Seconds_since(start));
+    start = train_clock::now();
+
+    Reduce_gradients(grad_slices);
+
+    Update_weights();
+    ++update_count;
+
+    epoch_stats.phase_seconds[PHASE_UPDATE] += Seconds_since(start);
+    epoch_stats.rows += curr_batch_rows;
+    epoch_stats.flops += Batch_flops();
+    ++epoch_stats.updates;
+
+    for(size_t i=0;i<grad_slices;++i)
+        error[curr_epoch] += partial_error[i];
+}
+
+template <typename T>
+void basic_rbm<T>::Attribute_phases(double wall)
+{
+    /* Splits a region's wall time by the workers' busy time per phase */
+    double busy[PHASE_COUNT] = { 0.0 };
+    double total = 0.0;
+
+    for(size_t w=0;w<phase_busy.rows();++w)
+    {
+        double *row = phase_busy.row(w);
+        for(size_t p=0;p<PHASE_COUNT;++p)
+        {
+            busy[p] += row[p];
+            total += row[p];
+            row[p] = 0.0;
+        }
+    }
+
+    if(total <= 0.0)
+        return;
+
+    for(size_t p=0;p<PHASE_COUNT;++p)
+        epoch_stats.phase_seconds[p] += wall*busy[p]/total;
+}
+
+template <typename T>
+double basic_rbm<T>::Batch_flops() const
+{
+    /* Dense Gemm products of one weight update, plus the update and error sweeps */
+    const double V = (double)num_visible;
+    const double H = (double)num_hidden;
+    const double B = (double)curr_batch_rows;
+    const double P = (double)num_particles;
+
+    double flops = 2*B*V*H;                     /* positive hidden probabilities */
+    if(num_particles)
+        flops += 2*B*V*H + 4*P*V*H*cd_steps;    /* reconstruction, particle steps */
+    else
+        flops += 4*B*V*H*cd_steps;              /* negative chain */
+
+    flops += 2*B*V*H + 2*(num_particles? P : B)*V*H;
+    flops += 3*V*H + 3*B*V;
+
+    return flops;
+}
+
+template <typename T>
+void basic_rbm<T>::Reduce_gradients(size_t slices)
+{
+    const size_t workers = pool->size();
+
+    /* Pairwise tree reduction of the partial sums into slice 0; the tree
+       follows the slices, the row blocks only share out the additions */
+    for(size_t stride=1;stride<slices;stride*=2)
+    {
+        size_t pairs = 0;
+        for(size_t i=0;i+stride<slices;i+=2*stride)
+            ++pairs;
+
+        /* Each pair is merged in row blocks so every worker gets a share */
+        size_t blocks = (workers + pairs - 1)/pairs;
+        if(blocks > (size_t)num_visible)
+            blocks = num_visible;
+
+        pool->Parallel_for(pairs*blocks, [&](size_t task, size_t)
+        {
+            size_t dst = (task/blocks)*2*stride;
+            size_t src = dst + stride;
+
+            rbm_gradient<T> &grad_dst = dst? partial_gradients[dst-1] : gradient;
+            const rbm_gradient<T> &grad_src = partial_gradients[src-1];
+
+            uint64_t first;
+            uint64_t count;
+            Row_slice(num_visible, blocks, task%blocks, first, count);
+
+            const simd_kernels<T> &simd = Simd<T>();
+            for(uint64_t r=first;r<first+count;++r)
+                simd.accumulate(grad_src.weights.row(r), grad_dst.weights.row(r), num_hidden);
+
+            /* The first block of a pair also merges the bias vectors */
+            if(task%blocks == 0)
+            {
+                simd.accumulate(grad_src.visible.data(), grad_dst.visible.data(), num_visible);
+                simd.accumulate(grad_src.hidden.data(), grad_dst.hidden.data(), num_hidden);
+            }
+        });
+    }
+}
+
+template <typename T>
+void basic_rbm<T>::Update_weights()
+{
+    size_t blocks = pool->size();
+    if(blocks > weights.rows())
+        blocks = weights.rows();
+
+    const double rate = curr_rate;
+    const double mu = momentum;
+    const bool look_ahead = nesterov;
+
+    /* The gradient is summed over the batch rows, so the decay is too */
+    const double decay_sum = weight_decay*curr_batch_rows;
+
+    /* One pass over parameters, gradient and velocity. Nesterov uses the
+       look-ahead form w += mu*v' + rate*g of v' = mu*v + rate*g */
+    auto step = [=](T *w, const T *g, T *v, uint64_t n, double decay)
+    {
+        if(mu == 0.0)
+        {
+            for(uint64_t j=0;j<n;++j)
+                w[j] += rate*(g[j] - decay*w[j]);
+            return;
+        }
+
+        for(uint64_t j=0;j<n;++j)
+        {
+            double delta = rate*(g[j] - decay*w[j]);
+            v[j] = mu*v[j] + delta;
+            w[j] += look_ahead? mu*v[j] + delta : v[j];
+        }
+    };
+
+    /* L2 decay applies to the weights only; the first block takes the biases */
+    pool->Parallel_for(blocks, [&](size_t task, size_t)
+    {
+        uint64_t first;
+        uint64_t count;
+        Row_slice(weights.rows(), blocks, task, first, count);
+
+        for(uint64_t i=first;i<first+count;++i)
+            step(weights.row(i), gradient.weights.row(i),
+                 mu? velocity.weights.row(i) : NULL, num_hidden, decay_sum);
+
+        if(task == 0)
+        {
+            step(visible_bias.data(), gradient.visible.data(),
+                 mu? velocity.visible.data() : NULL, num_visible, 0.0);
+            step(hidden_bias.data(), gradient.hidden.data(),
+                 mu? velocity.hidden.data() : NULL, num_hidden, 0.0);
+        }
+    });
+}
+
+template <typename T>
+double basic_rbm<T>::Update_error(uint64_t first, uint64_t count)
+{
+    /* Squared reconstruction error of rows [first, first+count) */
+    double sum = 0.0;
+
+    /* Sparse rows: sum of p^2 over the row, corrected by 1 - 2p at the ones */
+    if(sparse_input)
+    {
+        for(uint64_t i=first;i<first+count;++i)
+        {
+            const T *p = neg_visible_probs.row(i);
+            const uint32_t *cols = curr_sparse->row(i);
 
-        /* RBM Initialization Functions */
-        bool Init_bias(char *type = "zeros");
-        bool Init_weights(char *type = "gaussian");
-        bool Init_RBM(uint16_t no_hidden, uint16_t no_visible, double alpha);
+            for(uint64_t j=0;j<neg_visible_probs.cols();++j)
+                sum += (double)p[j]*p[j];
+            for(size_t z=0;z<curr_sparse->row_size(i);++z)
+                sum += 1.0 - 2.0*p[cols[z]];
+        }
 
-        /* RBM Parameters Configuration Functions */
-        void Config_probs();
-        void Config_error();
-        void Config_activations();
-        void Config_associations();
-        void Config_hiddden_states();
+        return sum;
+    }
 
-        /* RBM core Functions */
-        void Update_error();
-        void Compute_error();
-        void Set_data_bias();
-        void Update_weights();
-        void Mat_mul(bool course); /*{ 1= row-wise; 0 = column-wise } */
-        double Logistic(double value);
-        void Compute_neg_associations();
-        void Compute_pos_associations();
-		void Compute_probs(uint8_t flag);
-        void Compute_pos_hidden_states();
-		void Compute_pos_visible_states();
-		void Set_neg_visible_probs_bias();
-        void Compute_pos_hidden_activations();
-        void Compute_neg_hidden_activations();
-        void Compute_neg_visible_activations();
-        bool RBM_train(uint32_t epochs = 3000, bool method=FALSE);
-};
+    for(uint64_t i=first;i<first+count;++i)
+    {
+        for(uint64_t j=0;j<neg_visible_probs.cols();++j)
+        {
+            double diff = (double)curr_batch->get(i,j) - neg_visible_probs(i,j);
+            sum += diff*diff;
+        }
+    }
 
-void random::set_random_seed()
-{
-    srand (static_cast <unsigned> (time(0)));
+    return sum;
 }
 
-double random::generate_random(double lower_limit, double higher_limit)
+/* Row i of a binary matrix as n 0/1 elements */
+template <typename T>
+static void Unpack_row(const bit_matrix &m, size_t i, T *out, size_t n)
 {
-   return(lower_limit + static_cast <float> (rand())
-        /( static_cast <float> (RAND_MAX/(higher_limit-lower_limit))));
+    for(size_t j=0;j<n;++j)
+        out[j] = (T)m.get(i, j);
 }
 
-void RBM::set_std(double value)
+template <typename T>
+static void Unpack_row(const dense_bool &m, size_t i, T *out, size_t n)
 {
-    standard_deviation = value;
+    const uint8_t *r = m.row(i);
+    for(size_t j=0;j<n;++j)
+        out[j] = (T)(r[j]!= 0);
 }
 
-RBM::RBM()
+template <typename T>
+static void Unpack_row(const csr_matrix &m, size_t i, T *out, size_t n)
 {
-    cout<<"\n Initializing Restricted Boltzmann Machine ... Success\n";
+    const uint32_t *cols = m.row(i);
 
-    num_hidden = 0;
-    num_visible = 0;
-    learning_rate = 0.1;
-    curr_epoch=0;
-    epochs=0;
+    memset(out, 0, n*sizeof(T));
+    for(size_t p=0;p<m.row_size(i);++p)
+        out[cols[p]] = (T)1;
+}
 
-    error.reserve(1);
+template <typename T>
+template <typename M>
+void basic_rbm<T>::Evaluate_rows(const M &rows, uint64_t count, double &error, double &energy)
+{
+    /* Squared reconstruction error and free energy summed over count rows
+       spread evenly through rows; tiles go to the training pool and are
+       summed in tile order, so results do not depend on the thread count */
+    const uint64_t tiles = (count + GIBBS_TILE_ROWS - 1)/GIBBS_TILE_ROWS;
+    vect_double tile_error(tiles), tile_energy(tiles);
 
-    weights.reserve(1);
-    data.reserve(1);
+    pool->Parallel_for(tiles, [&](size_t t, size_t worker)
+    {
+        dense_matrix<T> &in = monitor_input[worker];
+        dense_matrix<T> &out = monitor_output[worker];
+        uint64_t first = t*GIBBS_TILE_ROWS;
+        uint64_t n = (count-first < GIBBS_TILE_ROWS)? count-first : GIBBS_TILE_ROWS;
+        double energies[GIBBS_TILE_ROWS];
 
-    pos_hidden_probs.reserve(1);
-    pos_associations.reserve(1);
-    pos_hidden_states.reserve(1);
-    pos_hidden_activations.reserve(1);
+        for(uint64_t i=0;i<n;++i)
+            Unpack_row(rows, (size_t)((first+i)*rows.rows()/count), in.row(i), num_visible);
 
-    neg_associations.reserve(1);
-    neg_hidden_probs.reserve(1);
-    neg_visible_probs.reserve(1);
-    neg_hidden_activations.reserve(1);
-    neg_visible_activations.reserve(1);
+        Free_energy(in.data(), in.row_stride(), n, energies);
+        Reconstruct(in.data(), in.row_stride(), n, out.data(), out.row_stride());
 
-    bias_init_type=0;
+        double sum_error = 0.0, sum_energy = 0.0;
+        for(uint64_t i=0;i<n;++i)
+        {
+            const T *v = in.row(i);
+            const T *r = out.row(i);
+            for(uint64_t j=0;j<num_visible;++j)
+            {
+                double diff = (double)v[j] - r[j];
+                sum_error += diff*diff;
+            }
+            sum_energy += energies[i];
+        }
 
-    set_random_seed();
-    set_std();
+        tile_error[t] = sum_error;
+        tile_energy[t] = sum_energy;
+    });
 
-    #if FILE
-        Create_file();
-    #endif // FILE
+    error = 0.0;
+    energy = 0.0;
+    for(uint64_t t=0;t<tiles;++t)
+    {
+        error += tile_error[t];
+        energy += tile_energy[t];
+    }
 }
 
-void RBM::Config_error()
+template <typename T>
+bool basic_rbm<T>::Monitor()
 {
-    error.resize(epochs);
-
-    #if DEBUG
-        cout<<"\n Error dimensions: 1 * "<<error.size()
-            <<"\n" ;
-    #endif // DEBUG
-
-    #if FILE
-        log_file.open("RBM_Log_File.txt",ios::app);
-        log_file<<"\n Error dimensions: 1 * "<<error.size()
-                <<"\n" ;
-    #endif // FILE
-}
+    /* Training sample: rows spread through the data in memory (the current
+       block when streaming) */
+    uint64_t train_rows = sparse_input? sparse_data.rows()
+                                      : (byte_input? byte_data.rows() : data.rows());
+    uint64_t valid_rows = valid_data.rows() + valid_sparse.rows();
+    uint64_t sample = monitor_sample_rows? monitor_sample_rows
+                                         : (valid_rows? valid_rows : MONITOR_SAMPLE_ROWS);
+    if(sample > train_rows)
+        sample = train_rows;
+
+    double train_error = 0.0, train_energy = 0.0;
+    if(sample)
+    {
+        if(sparse_input)
+            Evaluate_rows(sparse_data, sample, train_error, train_energy);
+        else if(byte_input)
+            Evaluate_rows(byte_data, sample, train_error, train_energy);
+        else
+            Evaluate_rows(data, sample, train_error, train_energy);
+        train_error /= sample;
+        train_energy /= sample;
+    }
 
-bool RBM::Create_file()
-{
-    if(Check_file("RBM_Log_File.txt"))
+    /* The held-out set drives early stopping when there is one */
+    double valid_error = train_error, valid_energy = train_energy;
+    if(valid_rows)
     {
-        remove("RBM_Log_File.txt");
-        #if DEBUG
-            cout<<"\n Previous log file found and replaced";
-        #endif // DEBUG
+        if(valid_sparse.rows())
+            Evaluate_rows(valid_sparse, valid_rows, valid_error, valid_energy);
+        else
+            Evaluate_rows(valid_data, valid_rows, valid_error, valid_energy);
+        valid_error /= valid_rows;
+        valid_energy /= valid_rows;
     }
 
-    log_file.open("RBM_Log_File.txt");
+    error[curr_epoch] = valid_error;
+    epoch_stats.valid_error = valid_error;
+    epoch_stats.free_energy_gap = valid_rows? valid_energy - train_energy : 0.0;
 
-    if(!log_file.is_open())
+    RBM_LOG(log_stream, LOG_DEBUG, " Validation error : "<<valid_error
+                                   <<", free energy gap : "<<epoch_stats.free_energy_gap<<"\n");
+
+    if(valid_error < monitor_best - monitor_min_delta)
     {
-        #if DEBUG
-            cout<<"\n Error: File not created \n";
-        #endif // DEBUG
+        monitor_best = valid_error;
+        monitor_best_epoch = curr_epoch + 1;
+        monitor_wait = 0;
         return FALSE;
     }
 
-    #if DEBUG
-            cout<<"\n File creation : Success \n";
-    #endif // DEBUG
-
-    time_t t = time(0);   // get time now
-    struct tm * now = localtime( & t );
-
-    log_file<<"\n Restricted Boltzmann Machine \n"
-            <<"\n Log Created on : "
-            <<  now->tm_mday<<'-'
-            << (now->tm_mon + 1) << '-'
-            << (now->tm_year + 1900)<<" "
-            << now->tm_hour<<':'
-            << now->tm_min<<':'
-            << now->tm_sec<<" Local Time"
-            <<" \n\n Initializing Restricted Boltzmann Machine...Success\n";
-    log_file.close();
-
-    return TRUE;
+    return monitor_patience && ++monitor_wait >= monitor_patience;
 }
 
-inline bool RBM::Check_file(const string &name)
+template <typename T>
+double basic_rbm<T>::Logistic(double value)
 {
-  struct stat buffer;
-  return (stat (name.c_str(), &buffer) == 0);
+    return(1.0/(1.0+exp(-1.0*value)));
 }
 
-
-bool RBM::Get_netstat()
+/* Per-thread scratch of the inference functions, GIBBS_TILE_ROWS rows at a time */
+template <typename T>
+struct inference_workspace
 {
-    return net_stat;
-}
+    dense_matrix<T> hidden;
+    dense_matrix<T> uniforms;
+};
 
-void RBM::Set_netstat(bool data)
+template <typename T>
+static inference_workspace<T> &Inference_workspace(uint64_t num_hidden)
 {
-    net_stat=data;
+    static thread_local inference_workspace<T> workspace;
 
+    if(workspace.hidden.cols() != num_hidden)
+    {
+        workspace.hidden.resize(GIBBS_TILE_ROWS, num_hidden);
+        workspace.uniforms.resize(1, num_hidden);
+    }
+    return workspace;
 }
 
-void RBM::Set_ready_to_train(bool data)
+template <typename T>
+template <typename V>
+bool basic_rbm<T>::Hidden_inputs(const V *visible, size_t ldv, uint64_t rows,
+                        T *hidden, size_t ldh, const char *caller) const
 {
-    ready_to_train = data;
+    if(!net_stat || weights.rows() == 0 || visible == NULL || hidden == NULL)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: "<<caller<<" : RBM haven't been initialized"
+                                       <<" or buffers missing\n");
+        return FALSE;
+    }
+
+    /* Hidden biases plus Visible * Weights */
+    Broadcast_rows(rows, hidden_bias.data(), num_hidden, hidden, ldh);
+
+    Gemm(false, false, rows, num_hidden, num_visible,
+         1.0, visible, ldv, weights.data(), weights.row_stride(),
+         1.0, hidden, ldh);
+
+    return TRUE;
 }
 
-bool RBM::Get_ready_to_train()
+template <typename T>
+template <typename V>
+bool basic_rbm<T>::Hidden_probs(const V *visible, size_t ldv, uint64_t rows,
+                       T *hidden, size_t ldh) const
 {
-    return ready_to_train;
+    if(!Hidden_inputs(visible, ldv, rows, hidden, ldh, "Hidden_probs"))
+        return FALSE;
+
+    const simd_kernels<T> &simd = Simd<T>();
+    for(uint64_t i=0;i<rows;++i)
+        simd.logistic(hidden + i*ldh, hidden + i*ldh, num_hidden);
+
+    return TRUE;
 }
 
-bool RBM::Init_RBM(uint16_t no_hidden, uint16_t no_visible, double alpha=0.1)
+template <typename T>
+template <typename V>
+bool basic_rbm<T>::Hidden_samples(const V *visible, size_t ldv, uint64_t rows, uint64_t request,
+                         uint8_t *states, size_t lds) const
 {
-    if(no_hidden <=0 || no_visible <=0)
+    if(states == NULL)
     {
-       Set_netstat(FALSE);
-       return FALSE;
-     }
-    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Hidden_samples : output buffer missing\n");
+        return FALSE;
+    }
+
+    inference_workspace<T> &work = Inference_workspace<T>(num_hidden);
+    T *u = work.uniforms.data();
+
+    /* Row i of a request draws from its own stream, so samples do not
+       depend on the tiling or on other requests */
+    for(uint64_t t=0;t<rows;t+=GIBBS_TILE_ROWS)
     {
-        num_hidden = no_hidden;
-        num_visible = no_visible;
-        learning_rate = alpha;
-        Set_netstat(TRUE);
+        uint64_t n = (rows-t < GIBBS_TILE_ROWS)? rows-t : GIBBS_TILE_ROWS;
+
+        if(!Hidden_probs(visible + t*ldv, ldv, n, work.hidden.data(), work.hidden.row_stride()))
+            return FALSE;
 
-        #if FILE
-            log_file.open("RBM_Log_File.txt",ios::app);
-            log_file<<"\n Number of Hidden Neurons  : "<<num_hidden
-                    <<"\n Number of Visible Neurons : "<<num_visible
-                    <<"\n Learning Rate             : "<<learning_rate
-                    <<"\n";
-            log_file.close();
-        #endif // FILE
+        for(uint64_t i=0;i<n;++i)
+        {
+            const T *p = work.hidden.row(i);
+            uint8_t *out = states + (t+i)*lds;
+
+            Fill_uniform(RNG_STREAM_INFERENCE, 0, request, t+i, u, num_hidden);
+            for(uint64_t j=0;j<num_hidden;++j)
+                out[j] = p[j] > u[j];
+        }
     }
 
     return TRUE;
 }
 
-bool RBM::Init_weights(char *type)
+template <typename T>
+template <typename V>
+bool basic_rbm<T>::Reconstruct(const V *visible, size_t ldv, uint64_t rows,
+                      T *reconstruction, size_t ldr) const
 {
-    if(Get_netstat())
+    if(reconstruction == NULL)
     {
-        weights.resize(num_visible+1);
-
-        for(uint16_t i=0; i<=num_visible;++i)
-        {
-            weights[i].resize(num_hidden+1);
-            for(uint16_t j=0; j<=num_hidden;++j)
-             {
-                weights[i][j] = (j&&i)?standard_deviation*generate_random(0.0,1.0):0.0;
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Reconstruct : output buffer missing\n");
+        return FALSE;
+    }
 
-             }
-        }
-     }
+    inference_workspace<T> &work = Inference_workspace<T>(num_hidden);
+    const simd_kernels<T> &simd = Simd<T>();
 
-    else
+    /* Mean-field pass: visible -> hidden probabilities -> visible probabilities */
+    for(uint64_t t=0;t<rows;t+=GIBBS_TILE_ROWS)
     {
-         cout<<"\n Error: RBM haven't been initialized yet!! \n";
+        uint64_t n = (rows-t < GIBBS_TILE_ROWS)? rows-t : GIBBS_TILE_ROWS;
+        T *out = reconstruction + t*ldr;
 
-         return FALSE;
+        if(!Hidden_probs(visible + t*ldv, ldv, n, work.hidden.data(), work.hidden.row_stride()))
+            return FALSE;
+
+        /* Visible biases plus Hidden * Transpose(Weights) */
+        Broadcast_rows(n, visible_bias.data(), num_visible, out, ldr);
+
+        Gemm(false, true, n, num_visible, num_hidden,
+             1.0, work.hidden.data(), work.hidden.row_stride(),
+             weights.data(), weights.row_stride(),
+             1.0, out, ldr);
+
+        for(uint64_t i=0;i<n;++i)
+            simd.logistic(out + i*ldr, out + i*ldr, num_visible);
     }
 
     return TRUE;
 }
 
-bool RBM::Init_bias(char *type)
+template <typename T>
+template <typename V>
+bool basic_rbm<T>::Free_energy(const V *visible, size_t ldv, uint64_t rows, double *energy) const
 {
-    if(Get_netstat())
+    if(energy == NULL)
     {
-        if((!strcmp(type,"zeros")))
-        {
-            bias_init_type = 0;
-        }
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Free_energy : output buffer missing\n");
+        return FALSE;
+    }
 
-        else if((!strcmp(type,"random")))
-        {
-            bias_init_type = 1;
-        }
-        else
-        {
-            cout<<" Error: Invalid input argument for Init_bias()\n";
+    inference_workspace<T> &work = Inference_workspace<T>(num_hidden);
 
-            return FALSE;
-        }
-    }
-    else
+    /* F(v) = -sum_i b_i v_i - sum_j log(1 + exp(c_j + v.W_j)) */
+    for(uint64_t t=0;t<rows;t+=GIBBS_TILE_ROWS)
     {
-         cout<<"\n Error: RBM haven't been initialized yet!! \n";
+        uint64_t n = (rows-t < GIBBS_TILE_ROWS)? rows-t : GIBBS_TILE_ROWS;
 
-         return FALSE;
+        if(!Hidden_inputs(visible + t*ldv, ldv, n, work.hidden.data(), work.hidden.row_stride(),
+                          "Free_energy"))
+            return FALSE;
+
+        for(uint64_t i=0;i<n;++i)
+        {
+            const V *v = visible + (t+i)*ldv;
+            const T *x = work.hidden.row(i);
+            double sum = 0.0;
+
+            for(uint64_t j=0;j<num_visible;++j)
+                sum -= visible_bias(0, j)*(double)v[j];
+
+            /* Overflow-safe softplus */
+            for(uint64_t j=0;j<num_hidden;++j)
+                sum -= (x[j] > 0.0)? x[j] + log1p(exp(-x[j])) : log1p(exp(x[j]));
+
+            energy[t+i] = sum;
+        }
     }
 
     return TRUE;
 }
 
-void RBM::Set_data_bias()
+/* Matrix text for the Display functions, one row per line */
+template <typename T>
+static string Format_matrix(const dense_matrix<T> &m, uint8_t precision, bool fixed)
 {
-    vect_bool::iterator it;
+    std::ostringstream text;
+    (fixed)? text<<std::fixed : text<<std::scientific;
+    text<<setprecision(precision);
 
-    for(uint16_t i=0;i<train_data_rows;++i)
+    for(size_t i=0;i<m.rows();++i)
     {
-        it = data[i].begin();
-        data[i].insert(it,1);
+        const T *row = m.row(i);
+        for(size_t j=0;j<m.cols();++j)
+            text<<row[j]<<"  ";
+        text<<"\n";
     }
+    return text.str();
+}
 
-    train_data_cols = data[0].size();
+static string Format_matrix(const bit_matrix &m, uint8_t, bool)
+{
+    string text;
+    text.reserve(m.rows()*(3*m.cols()+1));
+
+    for(size_t i=0;i<m.rows();++i)
+    {
+        for(size_t j=0;j<m.cols();++j)
+            text += m.get(i,j)? "1  " : "0  ";
+        text += "\n";
+    }
+    return text;
+}
 
+static inline bool Valid_display_args(uint8_t precision, const char *notation)
+{
+    return precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific")));
+}
 
+template <typename T>
+void basic_rbm<T>::Display_Neg_hidden_probs(uint8_t precision, char *notation)
+{
+    if(Valid_display_args(precision, notation))
+        RBM_LOG(log_stream, LOG_INFO, "\n Negative Hidden Probabilities\n"
+                                      <<Format_matrix(neg_hidden_probs, precision, !strcmp(notation,"fixed")));
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_Neg_hidden_probs()\n");
 }
 
-inline void RBM::Config_activations()
+template <typename T>
+void basic_rbm<T>::Display_Neg_visible_probs(uint8_t precision, char *notation)
 {
-    /* Configuring the Positive Hidden Activations */
-    pos_hidden_activations.resize(train_data_rows);
-    /* Configuring the Negative Hidden Activations */
-    neg_hidden_activations.resize(train_data_rows);
-    /* Configuring the Negative Visible Activations */
-    neg_visible_activations.resize(train_data_rows);
+    if(Valid_display_args(precision, notation))
+        RBM_LOG(log_stream, LOG_INFO, "\n Negative Visible Probabilities\n"
+                                      <<Format_matrix(neg_visible_probs, precision, !strcmp(notation,"fixed")));
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_Neg_visible_probs()\n");
+}
 
-    for(uint16_t i=0;i<train_data_rows;++i)
-    {
-        pos_hidden_activations[i].resize(num_hidden+1);
-        neg_hidden_activations[i].resize(num_hidden+1);
-        neg_visible_activations[i].resize(num_visible+1);
-    }
+template <typename T>
+void basic_rbm<T>::Display_Pos_hidden_probs(uint8_t precision, char *notation)
+{
+    if(Valid_display_args(precision, notation))
+        RBM_LOG(log_stream, LOG_INFO, "\n Positive Hidden Probabilities\n"
+                                      <<Format_matrix(pos_hidden_probs, precision, !strcmp(notation,"fixed")));
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_Pos_hidden_probs()\n");
+}
 
-   #if DEBUG
+template <typename T>
+void basic_rbm<T>::Display_Pos_hidden_States(uint8_t precision, char *notation)
+{
+    if(Valid_display_args(precision, notation))
+        RBM_LOG(log_stream, LOG_INFO, "\n Positive Hidden States\n"
+                                      <<Format_matrix(pos_hidden_states, precision, !strcmp(notation,"fixed")));
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_Pos_hidden_States()\n");
+}
 
-        cout<<"\n Pos_Hidden_Activation dimension : "<<pos_hidden_activations.size()
-            <<" * "<<pos_hidden_activations[0].size()
-            <<"\n Neg_Hidden_Activation dimension : "<<neg_hidden_activations.size()
-            <<" * "<<neg_hidden_activations[0].size()
-            <<"\n Neg_Visible_Activation dimension: "<<neg_visible_activations.size()
-            <<" * "<<neg_visible_activations[0].size()<<"\n";
-    #endif // DEBUG
+template <typename T>
+void basic_rbm<T>::Display_gradient(uint8_t precision, char *notation)
+{
+    if(Valid_display_args(precision, notation))
+        RBM_LOG(log_stream, LOG_INFO, "\n Gradient (Positive - Negative Associations) \n"
+                                      <<Format_matrix(gradient.weights, precision, !strcmp(notation,"fixed"))
+                                      <<"\n Visible Bias Gradient \n"
+                                      <<Format_matrix(gradient.visible, precision, !strcmp(notation,"fixed"))
+                                      <<"\n Hidden Bias Gradient \n"
+                                      <<Format_matrix(gradient.hidden, precision, !strcmp(notation,"fixed")));
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_gradient()\n");
+}
 
-    #if FILE
-        log_file.open("RBM_Log_File.txt",ios::app);
-        log_file<<"\n Pos_Hidden_Activation dimension : "<<pos_hidden_activations.size()
-                <<" * "<<pos_hidden_activations[0].size()
-                <<"\n Neg_Hidden_Activation dimension : "<<neg_hidden_activations.size()
-                <<" * "<<neg_hidden_activations[0].size()
-                <<"\n Neg_Visible_Activation dimension: "<<neg_visible_activations.size()
-                <<" * "<<neg_visible_activations[0].size()<<"\n";
-        log_file.close();
-    #endif // FILE
+template <typename T>
+void basic_rbm<T>::Display_data(uint8_t precision, char *notation)
+{
+    if(sparse_input)
+        RBM_LOG(log_stream, LOG_INFO, "\n Sparse data: "<<sparse_data.rows()<<" * "<<sparse_data.cols()
+                                      <<", "<<sparse_data.count_ones()<<" ones\n");
+    else if(byte_input)
+        RBM_LOG(log_stream, LOG_INFO, "\n Byte data view: "<<byte_data.rows()<<" * "<<byte_data.cols()<<"\n");
+    else if(Valid_display_args(precision, notation))
+        RBM_LOG(log_stream, LOG_INFO, Format_matrix(data, precision, !strcmp(notation,"fixed")));
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_Weights()\n");
 }
 
-inline void RBM::Config_probs()
+template <typename T>
+void basic_rbm<T>::Display_weights(uint8_t precision, char *notation)
 {
-    /* Configuring the Positive Hidden Probabilities */
-    pos_hidden_probs.resize(train_data_rows);
-    /* Configuring the Negative Hidden Probabilities */
-    neg_hidden_probs.resize(train_data_rows);
-    /* Configuring the Negative Visible Probabilities */
-    neg_visible_probs.resize(train_data_rows);
+    if(Valid_display_args(precision, notation))
+        RBM_LOG(log_stream, LOG_INFO, "\n Weights \n"
+                                      <<Format_matrix(weights, precision, !strcmp(notation,"fixed"))
+                                      <<"\n Visible Biases \n"
+                                      <<Format_matrix(visible_bias, precision, !strcmp(notation,"fixed"))
+                                      <<"\n Hidden Biases \n"
+                                      <<Format_matrix(hidden_bias, precision, !strcmp(notation,"fixed")));
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_Weights()\n");
+}
 
-    for(uint16_t i=0;i<train_data_rows;++i)
+template <typename T>
+void basic_rbm<T>::Display_error(uint8_t precision, char *notation)
+{
+    if(Valid_display_args(precision, notation))
     {
-        pos_hidden_probs[i].resize(num_hidden+1);
-        neg_hidden_probs[i].resize(num_hidden+1);
-        neg_visible_probs[i].resize(num_visible+1);
-    }
+        if(!log_stream.Enabled(LOG_INFO))
+            return;
 
-   #if DEBUG
+        std::ostringstream text;
+        (!strcmp(notation,"fixed"))? text<<std::fixed : text<<std::scientific;
+        text<<setprecision(precision)<<"\n Error \n";
 
-        cout<<"\n Pos_Hidden_Probs dimension : "<<pos_hidden_probs.size()
-            <<" * "<<pos_hidden_probs[0].size()
-            <<"\n Neg_Hidden_Probs dimension : "<<neg_hidden_probs.size()
-            <<" * "<<neg_hidden_probs[0].size()
-            <<"\n Neg_Visible_Probs dimension: "<<neg_visible_probs.size()
-            <<" * "<<neg_visible_probs[0].size()<<"\n";
-    #endif // DEBUG
+        for(uint64_t i=0;i<epochs;++i)
+            text<<error[i]<<"\n";
 
-    #if FILE
-        log_file.open("RBM_Log_File.txt",ios::app);
-        log_file<<"\n Pos_Hidden_Probs dimension : "<<pos_hidden_probs.size()
-                <<" * "<<pos_hidden_probs[0].size()
-                <<"\n Neg_Hidden_Probs dimension : "<<neg_hidden_probs.size()
-                <<" * "<<neg_hidden_probs[0].size()
-                <<"\n Neg_Visible_Probs dimension: "<<neg_visible_probs.size()
-                <<" * "<<neg_visible_probs[0].size()<<"\n";
-        log_file.close();
-    #endif // FILE
+        RBM_LOG(log_stream, LOG_INFO, text.str());
+    }
+    else
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Display_Weights()\n");
 }
 
-inline void RBM::Config_associations()
+template <typename T>
+bool basic_rbm<T>::Get_data(matrix_bool &arr, uint64_t nrows)
 {
-    /* Configuring the Positive Associations */
-    pos_associations.resize(num_visible+1);
-    /* Configuring the Negative Associations */
-    neg_associations.resize(num_visible+1);
+    source = NULL;
+    byte_input = FALSE;
+    byte_data.resize(0, 0);
+    sparse_input = FALSE;
+    sparse_data.clear(0);
 
-    for(uint16_t i=0;i<num_visible+1;++i)
+    if(nrows == 0 || nrows > arr.size() || arr[0].size()!= num_visible)
     {
-        pos_associations[i].resize(num_hidden+1);
-        neg_associations[i].resize(num_hidden+1);
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Get_data()\n");
+
+        return FALSE;
     }
 
-   #if DEBUG
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Input data dimensions: "<<nrows<<" * "<<arr[0].size());
 
-        cout<<"\n Pos_Associations dimension : "<<pos_associations.size()
-            <<" * "<<pos_associations[0].size()
-            <<"\n Neg_Associations dimension : "<<neg_associations.size()
-            <<" * "<<neg_associations[0].size()<<"\n";
+    try
+    {
+        data.resize(nrows, arr[0].size());
+    }
+    catch(const std::bad_alloc &)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for "<<nrows<<" * "
+                                       <<arr[0].size()<<" data\n");
+        return FALSE;
+    }
 
-    #endif // DEBUG
+    for(uint64_t i=0;i<nrows;++i)
+    {
+        uint64_t *row = data.row(i);
+        for(uint64_t j=0;j<num_visible;++j)
+            row[j>>6] |= (uint64_t)arr[i][j] << (j&63);
+    }
 
-    #if FILE
-        log_file.open("RBM_Log_File.txt",ios::app);
-        log_file<<"\n Pos_Associations dimension : "<<pos_associations.size()
-                <<" * "<<pos_associations[0].size()
-                <<"\n Neg_Associations dimension : "<<neg_associations.size()
-                <<" * "<<neg_associations[0].size()<<"\n";
-        log_file.close();
-    #endif // FILE
+    return TRUE;
 }
 
-inline void RBM::Config_hiddden_states()
+template <typename T>
+bool basic_rbm<T>::Get_data(data_source &rows)
 {
-    /* Configuring the Positive Hidden Activations */
-    pos_hidden_states.resize(train_data_rows);
+    /* Rows stay in the source and are streamed by RBM_train; the caller
+       keeps the source alive until training is done */
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Input data dimensions: "<<rows.rows()<<" * "<<rows.cols());
 
-    for(uint16_t i=0;i<train_data_rows;++i)
-        pos_hidden_states[i].resize(num_hidden+1);
+    if(rows.cols()!= num_visible)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Get_data()\n");
 
-    #if DEBUG
+        return FALSE;
+    }
 
-        cout<<"\n Pos_Hidden_States dimension : "<<pos_hidden_states.size()
-            <<" * "<<pos_hidden_states[0].size()<<"\n";
-    #endif // DEBUG
+    source = &rows;
+    data.resize(0, 0);
+    byte_input = FALSE;
+    byte_data.resize(0, 0);
+    sparse_input = FALSE;
+    sparse_data.clear(0);
 
-    #if FILE
-        log_file.open("RBM_Log_File.txt",ios::app);
-        log_file<<"\n Pos_Hidden_States dimension : "<<pos_hidden_states.size()
-                <<" * "<<pos_hidden_states[0].size()<<"\n";
-        log_file.close();
-    #endif // FILE
+    return TRUE;
 }
 
-inline void RBM::Compute_pos_hidden_activations()
+template <typename T>
+bool basic_rbm<T>::Get_data(const data_view &view)
 {
-    #if DEBUG
-        cout<<"\n Data + bias dimensions: "<<data.size()<<" * "
-            <<data[0].size()
-            <<"\n Weight dimensions: "<<weights.size()<<" * "
-            <<weights[0].size()
-            <<"\n";
-    #endif // DEBUG
+    /* Nothing is copied: the caller keeps the memory alive and unchanged
+       until training is done. Training only ever reads it */
+    const uint64_t words = (view.cols + 63)/64;
+    bool valid = view.ptr && view.rows && view.cols == num_visible;
 
-    double sum=0;
-    /* Data * Weights */
-    for(uint16_t x=0;x<train_data_rows;++x)
+    if(valid && view.layout == VIEW_BITS)
     {
-        for(uint16_t y=0; y<(num_hidden+1);++y)
-        {
-            sum=0.0;
-            for(uint16_t z=0; z< train_data_cols;++z)
-                sum += (double)data[x][z] * weights[z][y];
-            pos_hidden_activations[x][y]=sum;
-
-         }
-     }
-}
+        const uint64_t *row = static_cast<const uint64_t *>(view.ptr);
+        const uint64_t tail = (view.cols & 63)? ~(((uint64_t)1 << (view.cols & 63)) - 1) : 0;
 
-inline void RBM::Compute_neg_hidden_activations()
-{
-    #if DEBUG
-        cout<<"\n Neg_Visible_Probs dimensions: "<<neg_visible_probs.size()
-            <<" * "<<neg_visible_probs[0].size()
-            <<"\n Weight dimensions: "<<weights.size()<<" * "
-            <<weights[0].size()
-            <<"\n";
-    #endif // DEBUG
+        valid = ((uintptr_t)view.ptr & 7) == 0 && view.stride >= words;
+        for(uint64_t i=0;valid && i<view.rows;++i)
+            valid = !(row[i*view.stride + words-1] & tail);
+    }
+    else if(valid)
+        valid = (view.layout == VIEW_BOOL || view.layout == VIEW_UINT8) && view.stride >= view.cols;
 
-    double sum=0;
-    /* Negative Visible Probabilities * Weights */
-    for(uint16_t x=0;x<train_data_rows;++x)
+    if(!valid)
     {
-        for(uint16_t y=0; y<(num_hidden+1);++y)
-        {
-            sum=0.0;
-            for(uint16_t z=0; z< train_data_cols;++z)
-                sum += neg_visible_probs[x][z] * weights[z][y];
-            neg_hidden_activations[x][y]=sum;
-
-         }
-     }
-}
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Get_data()\n");
 
-inline void RBM::Compute_pos_associations()
-{
-     double sum=0;
-     /* Transpose(data) * Positive Hidden Probabilities - Row-wise */
-     for(uint16_t x=0;x<data[0].size();++x)
-     {
-         for(uint16_t y=0; y<pos_hidden_probs[0].size();++y)
-         {
-             sum=0.0;
-             for(uint16_t z=0; z< data.size();++z)
-                 sum += (double)data[z][x] * pos_hidden_probs[z][y];
-             pos_associations[x][y]=sum;
-
-          }
-     }
+        return FALSE;
+    }
 
-}
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Input data view: "<<view.rows<<" * "<<view.cols);
 
-inline void RBM::Compute_neg_associations()
-{
-     #if DEBUG
-        cout<<"\n Transpose(Neg_visible_Probs) dimensions: "<<neg_visible_probs[0].size()
-            <<" * "<<neg_visible_probs.size()
-            <<"\n Pos_hidden_Probs dimensions: "<<neg_hidden_probs.size()
-            <<" * "<<neg_hidden_probs[0].size()
-            <<"\n";
-    #endif // DEBUG
+    source = NULL;
+    sparse_input = FALSE;
+    sparse_data.clear(0);
 
-     double sum=0;
-     /* Transpose(Negative Visible Probabilities) * Negative Hidden Probabilities - Row-wise */
-     for(uint16_t x=0;x<neg_visible_probs[0].size();++x)
-     {
-         for(uint16_t y=0; y<neg_hidden_probs[0].size();++y)
-         {
-             sum=0.0;
-             for(uint16_t z=0; z< neg_visible_probs.size();++z)
-                 sum += neg_visible_probs[z][x] * neg_hidden_probs[z][y];
-             neg_associations[x][y]=sum;
-
-          }
-     }
+    byte_input = view.layout!= VIEW_BITS;
+    if(byte_input)
+    {
+        data.resize(0, 0);
+        byte_data.attach(static_cast<uint8_t *>(const_cast<void *>(view.ptr)),
+                         view.rows, view.cols, view.stride);
+    }
+    else
+    {
+        byte_data.resize(0, 0);
+        data.attach(static_cast<uint64_t *>(const_cast<void *>(view.ptr)),
+                    view.rows, view.cols, view.stride);
+    }
 
+    return TRUE;
 }
 
-inline void RBM::Compute_neg_visible_activations()
+template <typename T>
+bool basic_rbm<T>::Set_validation(matrix_bool &arr, uint64_t nrows)
 {
-    #if DEBUG
-        cout<<"\n Pos_hidden_States dimensions: "<<pos_hidden_states.size()
-            <<" * "<<pos_hidden_states[0].size()
-            <<"\n Transpose(Weights) dimensions: "<<weights[0].size()
-            <<" * "<<weights.size()
-            <<"\n";
-    #endif // DEBUG
+    /* Held-out rows, bit-packed; nrows == 0 clears the set */
+    valid_sparse.clear(0);
 
-    double sum=0;
-    /* Positive hidden states * Transpose(Weights)- column-wise */
-    for(uint16_t x=0;x<train_data_rows;++x)
+    if(nrows == 0)
     {
-        for(uint16_t y=0; y<(num_visible+1);++y)
-        {
-            sum=0.0;
-            for(uint16_t z=0; z< num_hidden+1;++z)
-                sum += pos_hidden_states[x][z] * weights[y][z];
-            neg_visible_activations[x][y]=sum;
-         }
-     }
+        valid_data.resize(0, 0);
+        return TRUE;
+    }
 
-}
+    if(nrows > arr.size() || arr[0].size()!= num_visible)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Set_validation()\n");
 
-void RBM::Compute_pos_hidden_states()
-{
-    for(uint16_t i=0;i<pos_hidden_states.size();++i)
+        return FALSE;
+    }
+
+    try
     {
-        for(uint16_t j=0;j<pos_hidden_states[i].size();++j)
-        {
-            pos_hidden_states[i][j] = (pos_hidden_probs[i][j] > generate_random(0.0,1.0))? TRUE:FALSE;
-        }
+        valid_data.resize(nrows, num_visible);
+    }
+    catch(const std::bad_alloc &)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for "<<nrows<<" * "
+                                       <<num_visible<<" validation data\n");
+        return FALSE;
     }
-}
 
-/*void RBM::Compute_pos_visible_states()
-{
-	for (uint16_t i = 0;i<data.size();++i)
-	{
-		data[0][i] = TRUE;
-		for (uint16_t j = 1;j<data[0].size();++j)
-		{
-			data[i][j] = (pos_visible_probs[i][j] > generate_random(0.0, 1.0)) ? TRUE : FALSE;
-		}
-	}
-}*/
+    for(uint64_t i=0;i<nrows;++i)
+    {
+        uint64_t *row = valid_data.row(i);
+        for(uint64_t j=0;j<num_visible;++j)
+            row[j>>6] |= (uint64_t)arr[i][j] << (j&63);
+    }
 
-void RBM::Set_neg_visible_probs_bias()
-{
-	for (uint16_t i = 0;i < neg_visible_probs.size();++i)
-		neg_visible_probs[i][0] = 1;
+    return TRUE;
 }
 
-bool RBM::RBM_train(uint32_t epchs, bool method)
+template <typename T>
+bool basic_rbm<T>::Set_validation(const csr_matrix &arr, uint64_t nrows)
 {
-    epochs = epchs;
-    uint16_t nrows = data.size();
-    uint16_t ncols = data[0].size();
+    /* Held-out rows kept in CSR; nrows == 0 clears the set */
+    valid_data.resize(0, 0);
 
-    train_data_rows = nrows;
-    train_data_cols = ncols;
+    if(nrows == 0)
+    {
+        valid_sparse.clear(0);
+        return TRUE;
+    }
+
+    if(nrows > arr.rows() || arr.cols()!= num_visible || !arr.valid())
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Set_validation()\n");
 
-    #if DEBUG
-        cout<<"\n RBM Data dimensions  : "<<train_data_rows<<" * "<<train_data_cols
-            <<"\n Weight dimensions: "<<num_visible+1<<" * "<<num_hidden+1<<"\n"
-            <<"\n Initial RBM Data \n";
-    #endif //DEBUG
+        return FALSE;
+    }
+
+    try
+    {
+        valid_sparse.clear(arr.cols());
+        for(uint64_t i=0;i<nrows;++i)
+        {
+            const uint32_t *cols = arr.row(i);
+            for(size_t p=0;p<arr.row_size(i);++p)
+                valid_sparse.add(cols[p]);
+            valid_sparse.end_row();
+        }
+    }
+    catch(const std::bad_alloc &)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for "<<nrows<<" * "
+                                       <<arr.cols()<<" validation data\n");
+        valid_sparse.clear(0);
+        return FALSE;
+    }
 
-    #if FILE
-        log_file.open("RBM_Log_File.txt",ios::app);
-        log_file<<"\n RBM Data Dimensions:"<<train_data_rows
-                <<" * "<<train_data_cols
-                <<"\n Weight dimensions: "<<num_visible+1<<" * "<<num_hidden+1<<"\n"
-                <<"\n Initial Data \n";
-        log_file.close();
-    #endif // FILE
+    return TRUE;
+}
 
-    Display_data();
+template <typename T>
+void basic_rbm<T>::Set_monitor(uint32_t every, uint32_t patience, double min_delta, uint64_t sample_rows)
+{
+    /* Every every-th epoch the monitor reconstructs the held-out set (or,
+       without one, sample_rows training rows) and stops the run once the
+       error has not improved by min_delta for patience evaluations. While
+       it runs, the per-batch training error sweep is skipped and the error
+       history holds the monitored error. every == 0 turns it off;
+       patience == 0 only monitors */
+    monitor_every = every;
+    monitor_patience = patience;
+    monitor_min_delta = min_delta;
+    monitor_sample_rows = sample_rows;
+}
 
-    if(ncols!= (num_visible))
+template <typename T>
+bool basic_rbm<T>::Get_data(const csr_matrix &arr, uint64_t nrows)
+{
+    /* The first nrows rows are copied; column indices are 32-bit */
+    if(nrows == 0 || nrows > arr.rows() || arr.cols()!= num_visible
+       || num_visible > UINT32_MAX || !arr.valid())
     {
-        cout<<" Error: Invalid data dimensions\n";
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Get_data()\n");
 
         return FALSE;
     }
 
-    else
-    {
-        if(Get_netstat())
-        {
-            /** Set Biases for the data as 1 **/
-            Set_data_bias();
+    size_t ones = 0;
+    for(uint64_t i=0;i<nrows;++i)
+        ones += arr.row_size(i);
 
-            #if DEBUG
-                cout<<"\n RBM Data dimensions with bias: "<<train_data_rows
-                    <<" * "<<train_data_cols<<"\n";
-            #endif //DEBUG
+    RBM_LOG(log_stream, LOG_DEBUG, "\n Input data dimensions: "<<nrows<<" * "<<arr.cols()
+                                   <<", "<<ones<<" ones");
 
-            #if FILE
-              log_file.open("RBM_Log_File.txt",ios::app);
-              log_file<<"\n RBM Data + Bias Dimensions: "<<train_data_rows
-                      <<" * "<<train_data_cols<<"\n"
-                      <<"\n RBM Data with Biases \n";
-              log_file.close();
-            #endif // FILE
-
-            /** Display Data **/
-            cout<<"\n RBM Data with Biases\n";
+    try
+    {
+        sparse_data.clear(arr.cols());
+        sparse_data.reserve(nrows, ones);
 
-            Display_data();
+        for(uint64_t i=0;i<nrows;++i)
+        {
+            const uint32_t *cols = arr.row(i);
+            for(size_t p=0;p<arr.row_size(i);++p)
+                sparse_data.add(cols[p]);
+            sparse_data.end_row();
+        }
+    }
+    catch(const std::bad_alloc &)
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Not enough memory for "<<nrows<<" * "
+                                       <<arr.cols()<<" sparse data\n");
+        return FALSE;
+    }
 
-            Display_weights();
+    source = NULL;
+    data.resize(0, 0);
+    byte_input = FALSE;
+    byte_data.resize(0, 0);
+    sparse_input = TRUE;
 
-            /** Configure RBM Parameters **/
-            Config_activations();
-            Config_probs();
-            Config_associations();
-            Config_hiddden_states();
-            Set_ready_to_train(TRUE);
-            Config_error();
-			
-            if(Get_ready_to_train())
-            {
+    return TRUE;
+}
 
-				/** Train Data **/
-				#if DEBUG
-					cout << "\n Training RBM ...\n\n";
-				#endif // DEBUG
+/*
+ * Hidden samples of a stack of trained layers over another source
+ *
+ * The input of a DBN layer above the first. Rows read from the input are
+ * pushed through the frozen layers DBN_TILE_ROWS at a time on a pool of
+ * the source's own, so nothing beyond the block being read is ever
+ * stored; with RBM_train's read-ahead, inference through the lower layers
+ * overlaps training of the upper one. Every tile and layer samples under
+ * its own request, so the rows a block yields depend only on the order of
+ * the reads. The layers must not change while the source is in use.
+ */
+#define DBN_TILE_ROWS 256
+
+template <typename T>
+class layer_source : public data_source
+{
+    private:
+        data_source *input;
+        std::vector<const basic_rbm<T> *> stack;
+        thread_pool pool;
+        bit_matrix block;
+        std::vector<std::vector<uint8_t> > tiles;   /* two per worker, DBN_TILE_ROWS x width */
+        uint64_t width;                             /* widest input or output of the stack */
+        uint64_t requests;                          /* sampling requests issued so far */
 
-				#if FILE
-					log_file.open("RBM_Log_File.txt", ios::app);
-					log_file << "\n Training RBM ...\n\n";
-					log_file.close();
-				#endif // FILE
+    public:
+        layer_source(data_source &rows, const std::vector<const basic_rbm<T> *> &layers,
+                     unsigned threads)
+            : input(&rows), stack(layers), pool(threads), width(rows.cols()), requests(0)
+        {
+            for(size_t l=0;l<stack.size();++l)
+                width = std::max(width, (uint64_t)stack[l]->Get_num_hidden());
 
-				time_t start_time = time(0);   // get time now
+            tiles.resize(2*pool.size());
+            for(size_t i=0;i<tiles.size();++i)
+                tiles[i].resize(DBN_TILE_ROWS*width);
+        }
 
-				for(curr_epoch=0;curr_epoch<epochs;++curr_epoch)
-                {
+        uint64_t rows() const { return input->rows(); }
+        uint64_t cols() const { return stack.back()->Get_num_hidden(); }
 
-                    #if DEBUG
-                        cout<<"\n Epoch : "<<curr_epoch+1
-                            <<"\n";
-                    #endif // DEBUG
+        bool Read_rows(uint64_t first, uint64_t count, bit_matrix &out)
+        {
+            if(!input->Read_rows(first, count, block))
+                return false;
 
-                    #if FILE
-                        log_file.open("RBM_Log_File.txt",ios::app);
-                        log_file<< "\n Epoch : "<<curr_epoch+1
-                                <<"\n";
-                        log_file.close();
-                    #endif // FILE
+            const uint64_t ntiles = (count + DBN_TILE_ROWS - 1)/DBN_TILE_ROWS;
+            const uint64_t base = requests;
+            std::atomic<bool> ok(true);
 
-					
+            requests += ntiles*stack.size();
+            out.resize(count, cols());
 
-					/* Gibbs Sampling */
-					for (uint16_t k = 0;k < 15;++k)
-					{
+            pool.Parallel_for(ntiles, [&](size_t t, size_t worker)
+            {
+                uint64_t row = t*DBN_TILE_ROWS;
+                uint64_t n = (count - row < DBN_TILE_ROWS)? count - row : DBN_TILE_ROWS;
+                uint8_t *in = &tiles[2*worker][0];
+                uint8_t *next = &tiles[2*worker+1][0];
 
-						// Data is simply the positive visible state
+                for(uint64_t i=0;i<n;++i)
+                    Unpack_row(block, row+i, in + i*width, input->cols());
 
-						Compute_pos_hidden_activations();
-						//Display_Pos_hidden_activation();
+                for(size_t l=0;l<stack.size();++l)
+                {
+                    if(!stack[l]->Hidden_samples(in, width, n, base + l*ntiles + t, next, width))
+                    {
+                        ok = false;
+                        return;
+                    }
+                    std::swap(in, next);
+                }
 
-						Compute_probs(1);
-						//Display_Pos_hidden_probs();
+                for(uint64_t i=0;i<n;++i)
+                    Pack_bytes(in + i*width, cols(), out.row(row+i));
+            });
 
-						Compute_pos_hidden_states();
-						//Display_Pos_hidden_States();
+            return ok;
+        }
+};
 
-						/*Compute_pos_associations();
-						Display_Pos_associations();*/
+/*
+ * Deep Belief Network trained greedily, one layer at a time
+ *
+ * Every layer is an ordinary basic_rbm, configured through Layer(i)
+ * between Init_DBN and DBN_train. Layer 0 trains on the data as given;
+ * each layer above trains on hidden samples of the frozen layers below,
+ * streamed block by block through a layer_source. Features() is the
+ * deterministic up-pass of hidden probabilities through every layer.
+ * Layer i logs to <prefix>_<i>.txt, so no layer replaces another's log.
+ */
+template <typename T>
+class basic_dbn
+{
+    private:
+        std::vector<std::unique_ptr<basic_rbm<T> > > layers;
+        std::vector<std::unique_ptr<layer_source<T> > > feeds;    /* input of layer i+1 */
 
-						/* Reconstruction of the visible unit from the hidden units*/
-						Set_neg_visible_probs_bias();
-						//Display_Neg_visible_probs(2);
+        data_source *source;
+        bool view_input;
+        data_view view;
+        view_source view_rows;
 
-						Compute_neg_visible_activations();
-						//Display_Neg_visible_activation(2);
+        unsigned inference_threads;
+        mutable logger log_stream;
+        string log_prefix;
+        log_level console_level;    /* applied to every layer */
+        log_level file_level;
 
-						Compute_probs(3);
-						//Display_Neg_visible_probs(2);
+    public:
+        basic_dbn();
 
-						Compute_neg_hidden_activations();
-						//Display_Neg_hidden_activation();
+        /* Takes effect at the next Init_DBN; an empty prefix logs to the console only */
+        void Set_log_file(const string &name_prefix);
 
-						Compute_probs(2);
-						//Display_Neg_hidden_probs();
+        bool Init_DBN(uint64_t no_visible, const std::vector<uint64_t> &hidden_sizes,
+                      double alpha = 0.1);
+        size_t Layers() const;
+        basic_rbm<T> &Layer(size_t i);
+        const basic_rbm<T> &Layer(size_t i) const;
 
-						/*Compute_neg_associations();
-						Display_Neg_associations();
+        /* The caller keeps the data alive until training is done */
+        bool Get_data(data_source &rows);
+        bool Get_data(const data_view &rows);
+        void Set_inference_threads(unsigned count = 0);
+        void Set_log_level(log_level console, log_level file);
 
-						Update_weights();
+        bool DBN_train(uint32_t epochs = 3000);
 
-						Update_error();*/
-					}
+        /* Hidden probabilities of the top layer, rows x Layer(Layers()-1) hidden units;
+           const and reentrant like the layers' inference functions */
+        template <typename V>
+        bool Features(const V *visible, size_t ldv, uint64_t rows, T *features, size_t ldf) const;
+};
 
-					if (curr_epoch >= 0.75*epochs)
-						learning_rate = 0.32;
-					else if (curr_epoch >= 0.95*epochs)
-						learning_rate = 0.42;
+typedef basic_dbn<double> DBN;
+typedef basic_dbn<float> DBN_float;
 
-					Compute_pos_associations();
-					//Display_Pos_associations();
+template <typename T>
+basic_dbn<T>::basic_dbn()
+{
+    source = NULL;
+    view_input = FALSE;
+    memset(&view, 0, sizeof(view));
+    inference_threads = 1;
+    log_prefix = "RBM_Log_File";
+    console_level = LOG_DEBUG;
+    file_level = LOG_DEBUG;
+    log_stream.Set_levels(console_level, LOG_OFF);
+}
 
-					Compute_neg_associations();
-					//Display_Neg_associations();
+template <typename T>
+void basic_dbn<T>::Set_log_file(const string &name_prefix)
+{
+    log_prefix = name_prefix;
+}
 
-					Update_weights();
+template <typename T>
+bool basic_dbn<T>::Init_DBN(uint64_t no_visible, const std::vector<uint64_t> &hidden_sizes,
+                            double alpha)
+{
+    if(no_visible == 0 || hidden_sizes.empty())
+    {
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Init_DBN()\n");
 
-					Update_error();
-                }
-				
-				time_t end_time = time(0) - start_time;   // get time now
-				struct tm * now = localtime(&end_time);
-
-				#if DEBUG
-					cout<< "\n Training Complete \n"
-						<< "\n Elpased Time : "
-						<< now->tm_hour << ':'
-						<< now->tm_min << ':'
-						<< now->tm_sec;						
-				#endif //DEBUG
-
-				#if FILE 
-					log_file.open("RBM_Log_File.txt", ios::app);
-					log_file<< "\n Training Complete \n"
-							<< "\n Elpased Time : "
-							<< now->tm_hour << ':'
-							<< now->tm_min << ':'
-							<< now->tm_sec;
-					log_file.close();
-				#endif //FILE
+        return FALSE;
+    }
 
-				Display_error(5,"fixed");
-								
-            }
+    layers.clear();
+    feeds.clear();
 
-       }
+    /* Each layer's visible units are the hidden units of the one below */
+    uint64_t visible = no_visible;
+    for(size_t i=0;i<hidden_sizes.size();++i)
+    {
+        std::ostringstream name;
+        if(!log_prefix.empty() && file_level != LOG_OFF)
+            name<<log_prefix<<"_"<<i<<".txt";
 
-        else
+        layers.push_back(std::unique_ptr<basic_rbm<T> >(
+            new basic_rbm<T>(name.str(), console_level, file_level)));
+        if(!layers.back()->Init_RBM(hidden_sizes[i], visible, alpha) || !layers.back()->Init_weights())
         {
-            cout<<"\n Error: RBM haven't been initialized yet!! \n";
+            RBM_LOG(log_stream, LOG_ERROR, "\n Error: Layer "<<i+1<<" could not be initialized\n");
+            layers.clear();
 
             return FALSE;
         }
+        visible = hidden_sizes[i];
     }
+
     return TRUE;
 }
 
-void RBM::Update_weights()
+template <typename T>
+size_t basic_dbn<T>::Layers() const
 {
-    for(uint16_t i=0;i<weights.size();++i)
-    {
-        for(uint16_t j=0;j<weights[0].size();++j)
-            weights[i][j]+=learning_rate*(pos_associations[i][j]-neg_associations[i][j]);
-    }
+    return layers.size();
 }
 
-void RBM::Update_error()
+template <typename T>
+basic_rbm<T> &basic_dbn<T>::Layer(size_t i)
 {
-    error[curr_epoch]=0.0;
-    for(uint16_t i=0;i<neg_visible_probs.size();++i)
-    {
-        for(uint16_t j=0;j<neg_visible_probs[0].size();++j)
-            error[curr_epoch] += pow(((double)data[i][j]- neg_visible_probs[i][j]),2);
-    }
-
+    return *layers[i];
 }
 
-double RBM::Logistic(double value)
+template <typename T>
+const basic_rbm<T> &basic_dbn<T>::Layer(size_t i) const
 {
-    return(1.0/(1.0+exp(-1.0*value)));
+    return *layers[i];
 }
 
-void RBM::Compute_probs(uint8_t flag)
+template <typename T>
+bool basic_dbn<T>::Get_data(data_source &rows)
 {
-    switch(flag)
+    if(layers.empty() || rows.cols()!= layers[0]->Get_num_visible())
     {
-        case 1:
-            /* Calculate the probabilities for positive hidden activations */
-            for(uint16_t i=0; i<pos_hidden_activations.size();++i)
-            {
-                for(uint16_t j=0;j<pos_hidden_activations[0].size();++j)
-                {
-                    pos_hidden_probs[i][j]=Logistic(pos_hidden_activations[i][j]);
-                }
-            }
-            break;
-        case 2:
-            /* Calculate the probabilities for negative hidden activations */
-            for(uint16_t i=0; i<neg_hidden_activations.size();++i)
-            {
-                for(uint16_t j=0;j<neg_hidden_activations[0].size();++j)
-                {
-                    neg_hidden_probs[i][j]=Logistic(neg_hidden_activations[i][j]);
-                }
-            }
-            break;
-        case 3:
-            /* Calculate the probabilities for negative visible activations */
-            for(uint16_t i=0; i<neg_visible_activations.size();++i)
-            {
-                for(uint16_t j=0;j<neg_visible_activations[0].size();++j)
-                {
-                    neg_visible_probs[i][j]=Logistic(neg_visible_activations[i][j]);
-                }
-            }
-            break;
-        default:
-            cout<<"\n Error: Invalid flag\n";
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Get_data()\n");
 
+        return FALSE;
     }
+
+    source = &rows;
+    view_input = FALSE;
+
+    return TRUE;
 }
 
-void RBM::Display_Pos_hidden_activation(uint8_t precision, char *notation)
+template <typename T>
+bool basic_dbn<T>::Get_data(const data_view &rows)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
+    /* Layer 0 takes the view itself and checks it; the layers above read it
+       through a view_source */
+    if(layers.empty() || !layers[0]->Get_data(rows))
     {
-        cout<<"\n Positive Hidden Activations\n";
-        for(uint16_t i=0;i<pos_hidden_activations.size();++i)
-        {
-            for(uint16_t j=0;j<pos_hidden_activations[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<pos_hidden_activations[i][j]<<"  ";
-            }
-            cout<<"\n";
-        }
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Get_data()\n");
+
+        return FALSE;
     }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Pos_hidden_activation()\n";
+
+    source = NULL;
+    view_input = TRUE;
+    view = rows;
+    view_rows = view_source(rows);
+
+    return TRUE;
 }
 
-void RBM::Display_Neg_hidden_activation(uint8_t precision, char *notation)
+template <typename T>
+void basic_dbn<T>::Set_inference_threads(unsigned count)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
-    {
-        cout<<"\n Negative Hidden Activations\n";
-        for(uint16_t i=0;i<neg_hidden_activations.size();++i)
-        {
-            for(uint16_t j=0;j<neg_hidden_activations[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<neg_hidden_activations[i][j]<<"  ";
-            }
-            cout<<"\n";
-        }
-    }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Neg_hidden_activation()\n";
+    /* 0 uses every hardware thread */
+    if(count == 0)
+        count = std::thread::hardware_concurrency();
+
+    inference_threads = (count == 0)? 1 : count;
 }
 
-void RBM::Display_Neg_visible_activation(uint8_t precision, char *notation)
+template <typename T>
+void basic_dbn<T>::Set_log_level(log_level console, log_level file)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
-    {
-        cout<<"\n Negative Visible Activations\n";
-        for(uint16_t i=0;i<neg_visible_activations.size();++i)
-        {
-            for(uint16_t j=0;j<neg_visible_activations[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<neg_visible_activations[i][j]<<"  ";
-            }
-            cout<<"\n";
-        }
-    }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Neg_visible_activation()\n";
+    console_level = console;
+    file_level = file;
+    log_stream.Set_levels(console, LOG_OFF);
+    for(size_t i=0;i<layers.size();++i)
+        layers[i]->Set_log_level(console, file);
 }
 
-void RBM::Display_Neg_hidden_probs(uint8_t precision, char *notation)
+template <typename T>
+bool basic_dbn<T>::DBN_train(uint32_t epochs)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
+    if(layers.empty() || (!source && !view_input))
     {
-        cout<<"\n Negative Hidden Probabilities\n";
-        for(uint16_t i=0;i<neg_hidden_probs.size();++i)
-        {
-            for(uint16_t j=0;j<neg_hidden_probs[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<neg_hidden_probs[i][j]<<"  ";
-            }
-            cout<<"\n";
-        }
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: DBN has no layers or no data\n");
+
+        return FALSE;
     }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Neg_hidden_probs()\n";
-}
 
-void RBM::Display_Neg_visible_probs(uint8_t precision, char *notation)
-{
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
+    data_source &input = view_input? static_cast<data_source &>(view_rows) : *source;
+    std::vector<const basic_rbm<T> *> below;
+
+    feeds.clear();
+    for(size_t i=0;i<layers.size();++i)
     {
-        cout<<"\n Negative Visible Probabilities\n";
-        for(uint16_t i=0;i<neg_visible_probs.size();++i)
+        basic_rbm<T> &layer = *layers[i];
+        bool ready;
+
+        RBM_LOG(log_stream, LOG_INFO, "\n Training layer "<<i+1<<" of "<<layers.size()<<" : "
+                                      <<layer.Get_num_visible()<<" * "<<layer.Get_num_hidden()<<"\n");
+
+        /* Layers above the first read the frozen stack's samples; the
+           sources live as long as the network, as the layers point at them */
+        if(i == 0)
+            ready = view_input? layer.Get_data(view) : layer.Get_data(input);
+        else
         {
-            for(uint16_t j=0;j<neg_visible_probs[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<neg_visible_probs[i][j]<<"  ";
-            }
-            cout<<"\n";
+            feeds.push_back(std::unique_ptr<layer_source<T> >(
+                            new layer_source<T>(input, below, inference_threads)));
+            ready = layer.Get_data(*feeds.back());
         }
-    }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Neg_hidden_probs()\n";
-}
 
-void RBM::Display_Pos_hidden_probs(uint8_t precision, char *notation)
-{
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
-    {
-        cout<<"\n Positive Hidden Probabilities\n";
-        for(uint16_t i=0;i<pos_hidden_probs.size();++i)
+        if(!ready || !layer.RBM_train(epochs))
         {
-            for(uint16_t j=0;j<pos_hidden_probs[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<pos_hidden_probs[i][j]<<"  ";
-            }
-            cout<<"\n";
+            RBM_LOG(log_stream, LOG_ERROR, "\n Error: Training layer "<<i+1<<" failed\n");
+
+            return FALSE;
         }
+
+        below.push_back(&layer);
     }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Pos_hidden_probs()\n";
+
+    return TRUE;
 }
 
-void RBM::Display_Pos_hidden_States(uint8_t precision, char *notation)
+template <typename T>
+template <typename V>
+bool basic_dbn<T>::Features(const V *visible, size_t ldv, uint64_t rows,
+                            T *features, size_t ldf) const
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
+    if(layers.empty())
+        return FALSE;
+
+    if(layers.size() == 1)
+        return layers[0]->Hidden_probs(visible, ldv, rows, features, ldf);
+
+    /* Intermediate probabilities a tile at a time, ping-ponged between two
+       buffers of the widest layer */
+    uint64_t width = 0;
+    for(size_t l=0;l+1<layers.size();++l)
+        width = std::max(width, (uint64_t)layers[l]->Get_num_hidden());
+
+    dense_matrix<T> a(GIBBS_TILE_ROWS, width), b(GIBBS_TILE_ROWS, width);
+
+    for(uint64_t t=0;t<rows;t+=GIBBS_TILE_ROWS)
     {
-        cout<<"\n Positive Hidden States\n";
-        for(uint16_t i=0;i<pos_hidden_states.size();++i)
+        uint64_t n = (rows-t < GIBBS_TILE_ROWS)? rows-t : GIBBS_TILE_ROWS;
+        dense_matrix<T> *in = &a, *out = &b;
+
+        if(!layers[0]->Hidden_probs(visible + t*ldv, ldv, n, in->data(), in->row_stride()))
+            return FALSE;
+
+        for(size_t l=1;l<layers.size();++l)
         {
-            for(uint16_t j=0;j<pos_hidden_states[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<pos_hidden_states[i][j]<<"  ";
-            }
-            cout<<"\n";
+            bool top = (l+1 == layers.size());
+            T *dst = top? features + t*ldf : out->data();
+            size_t ldd = top? ldf : out->row_stride();
+
+            if(!layers[l]->Hidden_probs(in->data(), in->row_stride(), n, dst, ldd))
+                return FALSE;
+            std::swap(in, out);
         }
     }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Pos_hidden_States()\n";
+
+    return TRUE;
 }
 
-void RBM::Display_Pos_associations(uint8_t precision, char *notation)
+/*
+ * Parallel hyperparameter sweep over one shared, read-only data set
+ *
+ * Every configuration trains its own model on the same data_view, which
+ * no run copies or writes. Runs are dealt to Set_runs() concurrent slots
+ * on a work-stealing pool, each model training on threads_per_run
+ * threads of its own; the runs of one slot carve their workspaces from
+ * the slot's arena. Run i logs to <prefix>_<i>.txt and, when asked, keeps
+ * its stats in <prefix>_<i>.jsonl and its model in <prefix>_<i>.ck. All
+ * runs start from the same seed, so they differ only by configuration.
+ */
+struct sweep_config
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
-    {
-        cout<<"\n Positive Associations \n";
-        for(uint16_t i=0;i<pos_associations.size();++i)
-        {
-            for(uint16_t j=0;j<pos_associations[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<pos_associations[i][j]<<"  ";
-            }
-            cout<<"\n";
-        }
-    }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Pos_associations()\n";
+    uint64_t hidden;
+    double learning_rate;
+    uint32_t cd_steps;
+    double standard_deviation;
+};
+
+struct sweep_result
+{
+    sweep_config config;
+    bool ok;
+    double error;           /* reconstruction error of the last epoch */
+    train_stats stats;      /* totals of the run */
+};
+
+template <typename T>
+class basic_sweep
+{
+    private:
+        data_view data;
+        bool has_data;
+        std::vector<sweep_config> configs;
+        std::vector<sweep_result> results;
+
+        unsigned concurrent_runs;
+        unsigned threads_per_run;
+        uint64_t batch_size;
+        uint64_t seed;
+        string prefix;
+        bool keep_stats;
+        bool keep_models;
+
+        log_level console_level;    /* of every run */
+        log_level file_level;
+        mutable logger log_stream;  /* the sweep's own console messages */
+
+        bool Run_config(size_t index, workspace_arena &arena, uint32_t epochs);
+
+    public:
+        basic_sweep();
+
+        /* The caller keeps the data alive and unchanged until Run_sweep returns */
+        bool Get_data(const data_view &rows);
+
+        void Add_config(const sweep_config &config);
+        void Add_grid(const std::vector<uint64_t> &hidden, const std::vector<double> &rates,
+                      const std::vector<uint32_t> &cd_steps, const std::vector<double> &deviations);
+        void Clear_configs();
+
+        void Set_runs(unsigned concurrent = 0, unsigned threads_per_run = 1);
+        void Set_batch_size(uint64_t size);
+        void Set_seed(uint64_t value);
+        void Set_output(const string &name_prefix, bool stats = FALSE, bool models = FALSE);
+        void Set_log_level(log_level console, log_level file);
+
+        bool Run_sweep(uint32_t epochs);
+
+        const std::vector<sweep_result> &Get_results() const;
+        size_t Best_run() const;
+};
+
+typedef basic_sweep<double> RBM_sweep;
+typedef basic_sweep<float> RBM_sweep_float;
+
+template <typename T>
+basic_sweep<T>::basic_sweep()
+{
+    memset(&data, 0, sizeof(data));
+    has_data = FALSE;
+    concurrent_runs = 1;
+    threads_per_run = 1;
+    batch_size = 0;
+    seed = (uint64_t)time(0);
+    prefix = "RBM_Sweep";
+    keep_stats = FALSE;
+    keep_models = FALSE;
+    console_level = LOG_ERROR;
+    file_level = LOG_DEBUG;
+    log_stream.Set_levels(LOG_INFO, LOG_OFF);
 }
 
-void RBM::Display_Neg_associations(uint8_t precision, char *notation)
+template <typename T>
+bool basic_sweep<T>::Get_data(const data_view &rows)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
+    /* Each run checks the view against its own width when it attaches it */
+    if(rows.ptr == NULL || rows.rows == 0 || rows.cols == 0)
     {
-        cout<<"\n Negative Associations \n";
-        for(uint16_t i=0;i<neg_associations.size();++i)
-        {
-            for(uint16_t j=0;j<neg_associations[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<neg_associations[i][j]<<"  ";
-            }
-            cout<<"\n";
-        }
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Invalid input arguments for Get_data()\n");
+
+        return FALSE;
     }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Neg_associations()\n";
+
+    data = rows;
+    has_data = TRUE;
+
+    return TRUE;
 }
 
-void RBM::Display_data(uint8_t precision, char *notation)
+template <typename T>
+void basic_sweep<T>::Add_config(const sweep_config &config)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
-    {
+    configs.push_back(config);
+}
 
-        for(uint16_t i=0;i<data.size();++i)
-        {
-            for(uint16_t j=0;j<data[0].size();++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<data[i][j]<<"  ";
-
-                #if FILE
-                    log_file.open("RBM_Log_File.txt",ios::app);
-                    (!strcmp(notation,"fixed"))? log_file<<std::fixed :
-                                             log_file<<std::scientific;
-                    log_file<<setprecision(precision)<<data[i][j]<<"  ";
-                    log_file.close();
-
-                #endif // FILE
-            }
-            cout<<"\n";
-            #if FILE
-                    log_file.open("RBM_Log_File.txt",ios::app);
-                    log_file<<"\n";
-                    log_file.close();
+template <typename T>
+void basic_sweep<T>::Add_grid(const std::vector<uint64_t> &hidden, const std::vector<double> &rates,
+                              const std::vector<uint32_t> &cd_steps,
+                              const std::vector<double> &deviations)
+{
+    /* Every combination, hidden size outermost */
+    for(size_t h=0;h<hidden.size();++h)
+        for(size_t r=0;r<rates.size();++r)
+            for(size_t k=0;k<cd_steps.size();++k)
+                for(size_t d=0;d<deviations.size();++d)
+                {
+                    sweep_config config = { hidden[h], rates[r], cd_steps[k], deviations[d] };
+                    configs.push_back(config);
+                }
+}
 
-            #endif // FILE
-        }
-    }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Weights()\n";
+template <typename T>
+void basic_sweep<T>::Clear_configs()
+{
+    configs.clear();
+    results.clear();
 }
 
-void RBM::Display_weights(uint8_t precision, char *notation)
+template <typename T>
+void basic_sweep<T>::Set_runs(unsigned concurrent, unsigned threads)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
-    {
+    /* 0 concurrent runs fills every hardware thread with threads-wide runs */
+    threads_per_run = (threads == 0)? 1 : threads;
 
-        cout<<"\n Weights & Biases \n";
+    if(concurrent == 0)
+        concurrent = std::thread::hardware_concurrency()/threads_per_run;
 
-        #if FILE
-              log_file.open("RBM_Log_File.txt",ios::app);
-              log_file<<"\n Weights & Biases \n";
-              log_file.close();
-        #endif // FILE
+    concurrent_runs = (concurrent == 0)? 1 : concurrent;
+}
 
-        for(uint16_t i=0;i<=num_visible;++i)
-        {
-            for(uint16_t j=0;j<=num_hidden;++j)
-            {
-                (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-                cout<<setprecision(precision)<<weights[i][j]<<"  ";
-
-                #if FILE
-                    log_file.open("RBM_Log_File.txt",ios::app);
-                    (!strcmp(notation,"fixed"))? log_file<<std::fixed :
-                                             log_file<<std::scientific;
-                    log_file<<setprecision(precision)<<weights[i][j]<<"  ";
-                    log_file.close();
-
-                #endif // FILE
-            }
-            cout<<"\n";
-            #if FILE
-                    log_file.open("RBM_Log_File.txt",ios::app);
-                    log_file<<"\n";
-                    log_file.close();
+template <typename T>
+void basic_sweep<T>::Set_batch_size(uint64_t size)
+{
+    batch_size = size;
+}
 
-            #endif // FILE
-        }
-    }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Weights()\n";
+template <typename T>
+void basic_sweep<T>::Set_seed(uint64_t value)
+{
+    seed = value;
 }
 
-void RBM::Display_error(uint8_t precision, char *notation)
+template <typename T>
+void basic_sweep<T>::Set_output(const string &name_prefix, bool stats, bool models)
 {
-    if(precision>0 && ((!strcmp(notation,"fixed"))||(!strcmp(notation,"scientific"))))
-    {
+    prefix = name_prefix;
+    keep_stats = stats;
+    keep_models = models;
+}
 
-        cout<<"\n Error \n";
+template <typename T>
+void basic_sweep<T>::Set_log_level(log_level console, log_level file)
+{
+    console_level = console;
+    file_level = file;
+    log_stream.Set_levels(console, LOG_OFF);
+}
 
-        #if FILE
-              log_file.open("RBM_Log_File.txt",ios::app);
-              log_file<<"\n Error \n";
-              log_file.close();
-        #endif // FILE
+template <typename T>
+bool basic_sweep<T>::Run_config(size_t index, workspace_arena &arena, uint32_t epochs)
+{
+    const sweep_config &config = configs[index];
+    sweep_result &result = results[index];
+    std::ostringstream name;
+    name<<prefix<<"_"<<index;
 
-        for(uint16_t i=0;i<epochs;++i)
-        {
-            (!strcmp(notation,"fixed"))? cout<<std::fixed :
-                                             cout<<std::scientific;
-            cout<<setprecision(precision)<<error[i]<<"\n";
+    /* Everything a run writes is its own: model, log and output files */
+    basic_rbm<T> net(file_level == LOG_OFF? string() : name.str() + ".txt",
+                     console_level, file_level);
 
-            #if FILE
-                log_file.open("RBM_Log_File.txt",ios::app);
-                (!strcmp(notation,"fixed"))? log_file<<std::fixed :
-                                         log_file<<std::scientific;
-                log_file<<setprecision(precision)<<error[i]<<"\n";
-                log_file.close();
-            #endif // FILE
+    if(!net.Init_RBM(config.hidden, data.cols, config.learning_rate))
+        return FALSE;
 
-        }
-    }
-    else
-        cout<<"\n Error: Invalid input arguments for Display_Weights()\n";
-}
+    net.set_std(config.standard_deviation);
+    net.set_random_seed(seed);
+    if(!net.Init_weights())
+        return FALSE;
 
-bool RBM::Get_data(matrix_bool &arr, uint16_t nrows)
-{
-    data.resize(nrows);
+    net.Set_cd_steps(config.cd_steps);
+    net.Set_batch_size(batch_size);
+    net.Set_threads(threads_per_run);
+    net.Set_workspace(&arena);
+
+    if(keep_stats && !net.Set_stats_file(name.str() + ".jsonl"))
+        return FALSE;
 
-    #if DEBUG
-        cout<<"\n Input data dimensions: "<<nrows<<" * "<<arr[0].size();
-    #endif // DEBUG
+    if(!net.Get_data(data) || !net.RBM_train(epochs))
+        return FALSE;
+
+    result.stats = net.Get_total_stats();
+    result.error = result.stats.error;
 
-    #if FILE
-              log_file.open("RBM_Log_File.txt",ios::app);
-              log_file<<"\n Input Data Dimensions: "
-                      <<nrows<<" * "<<arr[0].size();;
-              log_file.close();
-    #endif // FILE
+    return !keep_models || net.Save_checkpoint(name.str() + ".ck");
+}
 
-    if(arr[0].size()!= num_visible)
+template <typename T>
+bool basic_sweep<T>::Run_sweep(uint32_t epochs)
+{
+    if(!has_data || configs.empty())
     {
-        cout<<"\n Error: Invalid input arguments for Get_data()\n";
-        #if FILE
-              log_file.open("RBM_Log_File.txt",ios::app);
-              log_file<<"\n Error: Invalid input arguments for Get_data()\n";
-              log_file.close();
-        #endif // FILE
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: Sweep has no data or no configurations\n");
 
         return FALSE;
     }
 
-    for(int i=0;i<nrows;++i)
+    results.assign(configs.size(), sweep_result());
+    for(size_t i=0;i<configs.size();++i)
     {
-        data[i].resize(num_visible);
-        for(int j=0;j<num_visible;++j)
-            data[i][j]=arr[i][j];
+        memset(&results[i], 0, sizeof(results[i]));
+        results[i].config = configs[i];
+        results[i].error = HUGE_VAL;
     }
 
-    return TRUE;
+    /* One arena per slot: a slot trains one run at a time */
+    thread_pool slots(concurrent_runs);
+    std::vector<std::unique_ptr<workspace_arena> > arenas;
+    for(size_t i=0;i<slots.size();++i)
+        arenas.push_back(std::unique_ptr<workspace_arena>(new workspace_arena));
+
+    RBM_LOG(log_stream, LOG_INFO, "\n Sweep : "<<configs.size()<<" runs, "<<slots.size()
+                                  <<" at a time on "<<threads_per_run<<" threads each\n");
+
+    slots.Parallel_for(configs.size(), [&](size_t run, size_t slot)
+    {
+        try
+        {
+            results[run].ok = Run_config(run, *arenas[slot], epochs);
+        }
+        catch(const std::bad_alloc &)
+        {
+            results[run].ok = FALSE;
+        }
+    });
+
+    size_t failed = 0;
+    for(size_t i=0;i<results.size();++i)
+        failed += !results[i].ok;
+
+    if(failed)
+        RBM_LOG(log_stream, LOG_ERROR, "\n Error: "<<failed<<" of "<<results.size()
+                                       <<" sweep runs failed; see their logs\n");
+
+    return failed == 0;
+}
+
+template <typename T>
+const std::vector<sweep_result> &basic_sweep<T>::Get_results() const
+{
+    return results;
 }
 
+template <typename T>
+size_t basic_sweep<T>::Best_run() const
+{
+    /* Lowest final error among the runs that finished; results.size() if none */
+    size_t best = results.size();
+    for(size_t i=0;i<results.size();++i)
+        if(results[i].ok && (best == results.size() || results[i].error < results[best].error))
+            best = i;
+
+    return best;
+}
+
+template class basic_rbm<double>;
+template class basic_rbm<float>;
+template class basic_dbn<double>;
+template class basic_dbn<float>;
+template class basic_sweep<double>;
+template class basic_sweep<float>;
+
+/* Programs that include this file for the RBM classes (bench/rbm_bench.cpp)
+   define RBM_NO_MAIN and bring their own */
+#ifndef RBM_NO_MAIN
+
 int main()
 {
     RBM bolt_net;
@@ -1274,4 +6603,6 @@ int main()
     bolt_net.RBM_train(10);
 	
     return 0;
-}
\ No newline at end of file
+}
+
+#endif // RBM_NO_MAIN
\ No newline at end of file